@@ -0,0 +1,1171 @@
+/* Benchmarks of lgencall.c, in the style of Google Benchmark.
+   The file includes lgencall.c itself, so that internal functions like the format
+   parser can also be measured: it must be compiled with the same compilation
+   switches as the library, and linked with Lua only.
+   Each benchmark runs its loop with while(KeepRunning(state)), and the number of
+   iterations is increased until the loop lasts at least the minimum time.
+   Usage: lgencall_benchmark [--benchmark_filter=<regex>] [--benchmark_min_time=<seconds>]
+            [--benchmark_format=console|json] [--benchmark_out=<file>]
+            [--benchmark_out_format=console|json] [--benchmark_list_tests]
+   The JSON output has the layout of Google Benchmark, so that its tools/compare.py
+   script can compare the results of two commits. */
+
+#include "lgencall.c"
+#ifndef _WIN32
+#include <regex.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+#define MAX_BENCHMARKS 256
+#define MAX_COUNTERS 4
+#define MAX_ITERATIONS 1000000000
+
+typedef struct tBenchmarkState tBenchmarkState;
+typedef void (*tBenchmarkFct)(tBenchmarkState* state);
+
+struct tBenchmarkState
+{
+	long Arg;
+	size_t Iterations;
+	size_t Remaining;
+	int fStarted;
+	double StartReal, StartCpu;
+	double RealTime, CpuTime;      /* seconds spent in the timed part of the run */
+	double Items, Bytes;           /* processed by the whole run */
+	int NbCounters;
+	const char* CounterNames[MAX_COUNTERS];
+	double Counters[MAX_COUNTERS];
+	char Error[128];
+};
+
+typedef struct
+{
+	char Name[64];
+	tBenchmarkFct Fct;
+	long Arg;
+} tBenchmark;
+
+typedef struct
+{
+	const tBenchmark* Benchmark;
+	tBenchmarkState State;
+} tBenchmarkResult;
+
+static tBenchmark Benchmarks[MAX_BENCHMARKS];
+static int NbBenchmarks;
+static double MinTime = 0.5;
+
+static void RegisterBenchmark(const char* name, tBenchmarkFct fct, long arg)
+{
+	if(NbBenchmarks == MAX_BENCHMARKS)
+		return;
+	snprintf(Benchmarks[NbBenchmarks].Name, sizeof(Benchmarks[0].Name), "%s", name);
+	Benchmarks[NbBenchmarks].Fct = fct;
+	Benchmarks[NbBenchmarks].Arg = arg;
+	NbBenchmarks++;
+}
+
+/* Wall clock and processor time of the whole process, in seconds. The processor
+   time includes the worker threads of the executor benchmarks. */
+static double RealClock(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+static double CpuClock(void)
+{
+#ifdef _WIN32
+	FILETIME creation, exit, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+	return ((double)(((ULONGLONG)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) +
+		(double)(((ULONGLONG)user.dwHighDateTime << 32) | user.dwLowDateTime)) * 1e-7;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+static void PauseTiming(tBenchmarkState* state)
+{
+	state->RealTime += RealClock() - state->StartReal;
+	state->CpuTime += CpuClock() - state->StartCpu;
+}
+
+static void ResumeTiming(tBenchmarkState* state)
+{
+	state->StartReal = RealClock();
+	state->StartCpu = CpuClock();
+}
+
+/* Starts the timer on the first call, and stops it when all iterations are done */
+static int KeepRunning(tBenchmarkState* state)
+{
+	if(!state->fStarted)
+	{
+		state->fStarted = 1;
+		ResumeTiming(state);
+	}
+	if(state->Remaining > 0)
+	{
+		state->Remaining--;
+		return 1;
+	}
+	PauseTiming(state);
+	return 0;
+}
+
+/* Records the error message of a failed call, which also ends the benchmark */
+static int SkipWithError(tBenchmarkState* state, const char* error)
+{
+	if(error == NULL)
+		return 0;
+	if(state->Error[0] == 0)
+		snprintf(state->Error, sizeof(state->Error), "%s", error);
+	return 1;
+}
+
+static void SetCounter(tBenchmarkState* state, const char* name, double value)
+{
+	if(state->NbCounters < MAX_COUNTERS)
+	{
+		state->CounterNames[state->NbCounters] = name;
+		state->Counters[state->NbCounters++] = value;
+	}
+}
+
+static lua_State* NewBenchmarkState(void)
+{
+	lua_State* L = luaL_newstate();
+	luaL_openlibs(L);
+	return L;
+}
+
+/* Next number of iterations, with the same rule as Google Benchmark */
+static size_t PredictIterations(size_t iterations, double seconds)
+{
+	double multiplier = MinTime * 1.4 / (seconds > 1e-9 ? seconds : 1e-9);
+	double next;
+	if(seconds / MinTime <= 0.1)
+		multiplier = 10.0;
+	next = multiplier * (double)iterations;
+	if(next < (double)iterations + 1)
+		next = (double)iterations + 1;
+	return next > MAX_ITERATIONS ? MAX_ITERATIONS : (size_t)next;
+}
+
+static void RunBenchmark(const tBenchmark* bench, tBenchmarkState* state)
+{
+	size_t iterations = 1;
+	for(;;)
+	{
+		memset(state, 0, sizeof(tBenchmarkState));
+		state->Arg = bench->Arg;
+		state->Iterations = state->Remaining = iterations;
+		(*bench->Fct)(state);
+		if(state->Error[0] || state->RealTime >= MinTime || iterations >= MAX_ITERATIONS)
+			return;
+		iterations = PredictIterations(iterations, state->RealTime);
+	}
+}
+
+/*------------------------------------------------------------------------------
+   Reporters
+------------------------------------------------------------------------------*/
+
+static void PrintHumanReadable(FILE* file, double value)
+{
+	static const char units[] = " kMGT";
+	int i = 0;
+	while(value >= 1000 && i < 4)
+	{
+		value /= 1000;
+		i++;
+	}
+	if(i)
+		fprintf(file, "%.4g%c", value, units[i]);
+	else
+		fprintf(file, "%.4g", value);
+}
+
+static void PrintConsoleHeader(FILE* file)
+{
+	fprintf(file, "%s\n%-44s %13s %15s %12s\n%s\n",
+		"------------------------------------------------------------------------------------------",
+		"Benchmark", "Time", "CPU", "Iterations",
+		"------------------------------------------------------------------------------------------");
+}
+
+static void PrintConsoleResult(FILE* file, const tBenchmarkResult* res)
+{
+	const tBenchmarkState* state = &res->State;
+	int i;
+	if(state->Error[0])
+	{
+		fprintf(file, "%-44s ERROR OCCURRED: '%s'\n", res->Benchmark->Name, state->Error);
+		return;
+	}
+	fprintf(file, "%-44s %10.0f ns %12.0f ns %12lu", res->Benchmark->Name,
+		state->RealTime * 1e9 / (double)state->Iterations, state->CpuTime * 1e9 / (double)state->Iterations,
+		(unsigned long)state->Iterations);
+	if(state->Bytes > 0 && state->CpuTime > 0)
+	{
+		fprintf(file, " bytes_per_second=");
+		PrintHumanReadable(file, state->Bytes / state->CpuTime);
+		fprintf(file, "/s");
+	}
+	if(state->Items > 0 && state->CpuTime > 0)
+	{
+		fprintf(file, " items_per_second=");
+		PrintHumanReadable(file, state->Items / state->CpuTime);
+		fprintf(file, "/s");
+	}
+	for(i=0;i<state->NbCounters;i++)
+	{
+		fprintf(file, " %s=", state->CounterNames[i]);
+		PrintHumanReadable(file, state->Counters[i]);
+	}
+	fprintf(file, "\n");
+}
+
+static void PrintJsonString(FILE* file, const char* str)
+{
+	fputc('"', file);
+	for(;*str;str++)
+	{
+		if(*str == '"' || *str == '\\')
+			fprintf(file, "\\%c", *str);
+		else if((unsigned char)*str < 0x20)
+			fprintf(file, "\\u%04x", (unsigned char)*str);
+		else
+			fputc(*str, file);
+	}
+	fputc('"', file);
+}
+
+static int GetNumberOfCpus(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+#else
+	return (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+static void PrintJson(FILE* file, const char* executable, const tBenchmarkResult* results, int nbresults)
+{
+	char date[32], host[256] = "";
+	time_t now = time(NULL);
+	int i, j;
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+#ifdef _WIN32
+	{
+		DWORD size = sizeof(host);
+		GetComputerNameA(host, &size);
+	}
+#else
+	gethostname(host, sizeof(host) - 1);
+#endif
+	fprintf(file, "{\n  \"context\": {\n    \"date\": ");
+	PrintJsonString(file, date);
+	fprintf(file, ",\n    \"host_name\": ");
+	PrintJsonString(file, host);
+	fprintf(file, ",\n    \"executable\": ");
+	PrintJsonString(file, executable);
+	fprintf(file, ",\n    \"num_cpus\": %d,\n    \"mhz_per_cpu\": 0,\n    \"cpu_scaling_enabled\": false,\n"
+		"    \"caches\": [],\n    \"library_build_type\": \"%s\",\n    \"lua_version\": ",
+		GetNumberOfCpus(),
+#ifdef NDEBUG
+		"release"
+#else
+		"debug"
+#endif
+		);
+	PrintJsonString(file, LUA_RELEASE);
+	fprintf(file, ",\n    \"lgencall_switches\": \"WIDESTRING=%d 64_BITS=%d LONG_DOUBLE=%d LUA_INTERNALS=%d "
+		"FORK=%d BYTECODE_STORE=%d TRACE=%d THREADS=%d\"\n  },\n  \"benchmarks\": [",
+		LGENCALL_USE_WIDESTRING, LGENCALL_USE_64_BITS, LGENCALL_USE_LONG_DOUBLE, LGENCALL_USE_LUA_INTERNALS,
+		LGENCALL_USE_FORK, LGENCALL_USE_BYTECODE_STORE, LGENCALL_USE_TRACE, LGENCALL_USE_THREADS);
+	for(i=0;i<nbresults;i++)
+	{
+		const tBenchmarkState* state = &results[i].State;
+		fprintf(file, "%s\n    {\n      \"name\": ", i ? "," : "");
+		PrintJsonString(file, results[i].Benchmark->Name);
+		fprintf(file, ",\n      \"run_name\": ");
+		PrintJsonString(file, results[i].Benchmark->Name);
+		fprintf(file, ",\n      \"run_type\": \"iteration\",\n      \"repetitions\": 1,\n"
+			"      \"repetition_index\": 0,\n      \"threads\": 1,\n");
+		if(state->Error[0])
+		{
+			fprintf(file, "      \"error_occurred\": true,\n      \"error_message\": ");
+			PrintJsonString(file, state->Error);
+			fprintf(file, "\n    }");
+			continue;
+		}
+		fprintf(file, "      \"iterations\": %lu,\n      \"real_time\": %.6e,\n      \"cpu_time\": %.6e,\n"
+			"      \"time_unit\": \"ns\"", (unsigned long)state->Iterations,
+			state->RealTime * 1e9 / (double)state->Iterations, state->CpuTime * 1e9 / (double)state->Iterations);
+		if(state->Bytes > 0 && state->CpuTime > 0)
+			fprintf(file, ",\n      \"bytes_per_second\": %.6e", state->Bytes / state->CpuTime);
+		if(state->Items > 0 && state->CpuTime > 0)
+			fprintf(file, ",\n      \"items_per_second\": %.6e", state->Items / state->CpuTime);
+		for(j=0;j<state->NbCounters;j++)
+		{
+			fprintf(file, ",\n      ");
+			PrintJsonString(file, state->CounterNames[j]);
+			fprintf(file, ": %.6e", state->Counters[j]);
+		}
+		fprintf(file, "\n    }");
+	}
+	fprintf(file, "\n  ]\n}\n");
+}
+
+/*------------------------------------------------------------------------------
+   Benchmarks
+------------------------------------------------------------------------------*/
+
+static void BM_Scalars(tBenchmarkState* state)
+{
+	lua_State* L = NewBenchmarkState();
+	double sum = 0;
+	int flag = 0;
+	while(KeepRunning(state))
+		if(SkipWithError(state, lua_genpcallA(L, "local a, b, c = ...; return a + b, not c",
+			"%d%lf%b>%lf%b", 1, 2.5, 0, &sum, &flag)))
+			break;
+	state->Items = (double)state->Iterations;
+	lua_close(L);
+}
+
+/* Overhead of a protected generic call, against an unprotected one and against
+   the same call made directly with the Lua API, all calling the global function f:
+   0 is lua_pcall, 1 lua_genpcallA with the chunk "return f(...)", 2 with the reference
+   to f returned by %&R, which saves the frame of the chunk, and 3 lua_gencallA */
+static void BM_CallOverhead(tBenchmarkState* state)
+{
+	static const char* script = "return f(...)";
+	lua_State* L = NewBenchmarkState();
+	int ref = LUA_NOREF, res = 0;
+	SkipWithError(state, lua_genpcallA(L, "function f(x) return x + 1 end", ""));
+	if(!state->Error[0])
+		SkipWithError(state, lua_genpcallA(L, "f", "%&R<%d>%d", &ref, res, &res));
+	while(!state->Error[0] && KeepRunning(state))
+	{
+		switch(state->Arg)
+		{
+		case 0:
+			lua_getglobal(L, "f");
+			lua_pushinteger(L, res);
+			if(lua_pcall(L, 1, 1, 0))
+				SkipWithError(state, lua_tostring(L, -1));
+			res = (int)lua_tointeger(L, -1);
+			lua_pop(L, 1);
+			break;
+		case 1:
+			SkipWithError(state, lua_genpcallA(L, script, "%d>%d", res, &res));
+			break;
+		case 2:
+			SkipWithError(state, lua_genpcallA(L, NULL, "%R<%d>%d", ref, res, &res));
+			break;
+		default:
+			lua_gencallA(L, script, "%d>%d", res, &res);
+			break;
+		}
+		if(state->Error[0])
+			break;
+	}
+	state->Items = (double)state->Iterations;
+	lua_close(L);
+}
+
+/* Scalar outputs with the type checks of the strict mode, or trusted with '!' */
+static void BM_OutputChecks(tBenchmarkState* state)
+{
+	lua_State* L = NewBenchmarkState();
+	const char* format = state->Arg ? ">%!d%!lf%!b%!hd%!f%!ld%!lb%!hhd" : ">%d%lf%b%hd%f%ld%lb%hhd";
+	int i1 = 0, b1 = 0, b2 = 0;
+	double d1 = 0;
+	short s1 = 0;
+	float f1 = 0;
+	long l1 = 0;
+	char c1 = 0;
+	while(KeepRunning(state))
+		if(SkipWithError(state, lua_genpcallA(L, "return 1, 2.5, true, 3, 4.5, 5, false, 6", format,
+			&i1, &d1, &b1, &s1, &f1, &l1, &b2, &c1)))
+			break;
+	state->Items = (double)state->Iterations * 8;
+	lua_close(L);
+}
+
+/* Creation of a state with all the standard libraries, with the base, string and math
+   libraries only, or with package too and the others preloaded. The time of lua_close
+   is not counted. */
+static void BM_StateStartup(tBenchmarkState* state)
+{
+	static const unsigned int masks[] =
+	{
+		LGENCALL_LIB_ALL,
+		LGENCALL_LIB_BASE | LGENCALL_LIB_STRING | LGENCALL_LIB_MATH,
+		LGENCALL_LIB_BASE | LGENCALL_LIB_PACKAGE | LGENCALL_LIB_STRING | LGENCALL_LIB_MATH,
+	};
+	double bytes = 0;
+	while(KeepRunning(state))
+	{
+		lua_State* L = NULL;
+		if(SkipWithError(state, lua_genpcallA(NULL, NULL, "%*O %S<", masks[state->Arg], &L)))
+			break;
+		PauseTiming(state);
+		bytes = lua_gc(L, LUA_GCCOUNT, 0) * 1024.0 + lua_gc(L, LUA_GCCOUNTB, 0);
+		lua_close(L);
+		ResumeTiming(state);
+	}
+	state->Items = (double)state->Iterations;
+	SetCounter(state, "bytes_per_state", bytes);
+}
+
+/* Calls with 1, 8 and 64 integer arguments, which must stay as fast as before
+   the wider element descriptor */
+#define ARGS8(x) x, x, x, x, x, x, x, x
+#define ARGS64(x) ARGS8(x), ARGS8(x), ARGS8(x), ARGS8(x), ARGS8(x), ARGS8(x), ARGS8(x), ARGS8(x)
+
+static void BM_Arguments(tBenchmarkState* state)
+{
+	lua_State* L = NewBenchmarkState();
+	char format[200];
+	int i, res = 0;
+	for(i=0;i<state->Arg;i++)
+		memcpy(format + 2*i, "%d", 2);
+	strcpy(format + 2*state->Arg, ">%d");
+	while(KeepRunning(state))
+	{
+		const char* error;
+		if(state->Arg == 1)
+			error = lua_genpcallA(L, "return select('#', ...)", format, 1, &res);
+		else if(state->Arg == 8)
+			error = lua_genpcallA(L, "return select('#', ...)", format, ARGS8(1), &res);
+		else
+			error = lua_genpcallA(L, "return select('#', ...)", format, ARGS64(1), &res);
+		if(SkipWithError(state, error))
+			break;
+	}
+	if(res != state->Arg)
+		SkipWithError(state, "wrong number of arguments");
+	state->Items = (double)state->Iterations * (double)state->Arg;
+	lua_close(L);
+}
+
+/* Numerical and boolean array types, one per entry of TypeSizes */
+typedef struct
+{
+	const char* Name;
+	const char* Format;
+	size_t Size;
+	int fBoolean;
+} tArrayType;
+
+static const tArrayType ArrayTypes[] =
+{
+	{ "float",       "f",   sizeof(float),       0 },
+	{ "double",      "lf",  sizeof(double),      0 },
+#if LGENCALL_USE_LONG_DOUBLE
+	{ "long_double", "Lf",  sizeof(long double), 0 },
+#endif
+	{ "int",         "d",   sizeof(int),         0 },
+	{ "long",        "ld",  sizeof(long),        0 },
+	{ "short",       "hd",  sizeof(short),       0 },
+	{ "char",        "hhd", sizeof(char),        0 },
+#if LGENCALL_USE_64_BITS
+	{ "int64",       "Ld",  sizeof(int64_t),     0 },
+#endif
+	{ "bool",        "b",   sizeof(int),         1 },
+	{ "int_bool",    "lb",  sizeof(int),         1 },
+	{ "char_bool",   "hb",  sizeof(char),        1 },
+};
+
+#define ARRAY_SIZE 1024
+
+static void BM_InputArray(tBenchmarkState* state)
+{
+	const tArrayType* type = ArrayTypes + state->Arg;
+	lua_State* L = NewBenchmarkState();
+	void* data = calloc(ARRAY_SIZE, type->Size);
+	char format[16];
+	int len = 0;
+	sprintf(format, "%%*%s>%%d", type->Format);
+	while(KeepRunning(state))
+		if(SkipWithError(state, lua_genpcallA(L, "return #...", format, ARRAY_SIZE, data, &len)))
+			break;
+	state->Items = (double)state->Iterations * ARRAY_SIZE;
+	state->Bytes = state->Items * (double)type->Size;
+	free(data);
+	lua_close(L);
+}
+
+static void BM_OutputArray(tBenchmarkState* state)
+{
+	const tArrayType* type = ArrayTypes + state->Arg;
+	lua_State* L = NewBenchmarkState();
+	void* data = calloc(ARRAY_SIZE, type->Size);
+	char format[16];
+	sprintf(format, ">%%*%s", type->Format);
+	SkipWithError(state, lua_genpcallA(L, type->fBoolean ? "T = {}; for i = 1, ... do T[i] = i % 2 == 0 end"
+		: "T = {}; for i = 1, ... do T[i] = i % 100 end", "%d", ARRAY_SIZE));
+	while(!state->Error[0] && KeepRunning(state))
+		if(SkipWithError(state, lua_genpcallA(L, "return T", format, ARRAY_SIZE, data)))
+			break;
+	state->Items = (double)state->Iterations * ARRAY_SIZE;
+	state->Bytes = state->Items * (double)type->Size;
+	free(data);
+	lua_close(L);
+}
+
+/* Numerical output arrays from 1k to 10M elements, read from the array part of
+   the table with LGENCALL_USE_LUA_INTERNALS */
+static void BM_OutputArraySize(tBenchmarkState* state)
+{
+	lua_State* L = NewBenchmarkState();
+	double* data = (double*)malloc(state->Arg * sizeof(double));
+	SkipWithError(state, lua_genpcallA(L, "T = {}; for i = 1, ... do T[i] = i end", "%d", (int)state->Arg));
+	while(!state->Error[0] && KeepRunning(state))
+		if(SkipWithError(state, lua_genpcallA(L, "return T", ">%*lf", (int)state->Arg, data)))
+			break;
+	state->Items = (double)state->Iterations * (double)state->Arg;
+	state->Bytes = state->Items * sizeof(double);
+	free(data);
+	lua_close(L);
+}
+
+static void BM_String(tBenchmarkState* state)
+{
+	lua_State* L = NewBenchmarkState();
+	char* input = (char*)malloc(state->Arg + 1);
+	char* output = (char*)malloc(state->Arg + 1);
+	memset(input, 'x', state->Arg);
+	input[state->Arg] = 0;
+	while(KeepRunning(state))
+		if(SkipWithError(state, lua_genpcallA(L, "return ...", "%s>%*s", input, (int)state->Arg + 1, output)))
+			break;
+	state->Bytes = (double)state->Iterations * (double)state->Arg * 2;
+	free(input);
+	free(output);
+	lua_close(L);
+}
+
+#if LGENCALL_USE_WIDESTRING
+static void BM_WideString(tBenchmarkState* state)
+{
+	lua_State* L = NewBenchmarkState();
+	wchar_t* input = (wchar_t*)malloc((state->Arg + 1) * sizeof(wchar_t));
+	wchar_t* output = (wchar_t*)malloc((state->Arg + 1) * sizeof(wchar_t));
+	long i;
+	for(i=0;i<state->Arg;i++)
+		input[i] = i % 2 ? L'x' : 0xE9;
+	input[state->Arg] = 0;
+	while(KeepRunning(state))
+		if(SkipWithError(state, lua_genpcallA(L, "return ...", "%ls>%*ls", input, (int)state->Arg + 1, output)))
+			break;
+	state->Bytes = (double)state->Iterations * (double)state->Arg * 2 * sizeof(wchar_t);
+	free(input);
+	free(output);
+	lua_close(L);
+}
+#endif
+
+static void BM_StringList(tBenchmarkState* state)
+{
+	lua_State* L = NewBenchmarkState();
+	char* list = (char*)malloc(state->Arg * 8 + 1);
+	char* output = (char*)malloc(state->Arg * 8 + 1);
+	long i;
+	for(i=0;i<state->Arg;i++)
+		sprintf(list + i*8, "item%03ld", i % 1000);
+	list[state->Arg * 8] = 0;
+	while(KeepRunning(state))
+		if(SkipWithError(state, lua_genpcallA(L, "return ...", "%z>%*z", list, (int)state->Arg * 8 + 1, output)))
+			break;
+	state->Items = (double)state->Iterations * (double)state->Arg * 2;
+	free(list);
+	free(output);
+	lua_close(L);
+}
+
+/* Garbage made by the input tables of a hot call, created by each call or reused with '+'
+   for an array and a string list of fixed shape. The allocator of the state counts the
+   bytes allocated by the calls. */
+static void* CountingAlloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+	if(nsize == 0)
+	{
+		free(ptr);
+		return NULL;
+	}
+	if(nsize > osize)
+		*(size_t*)ud += nsize - osize;
+	return realloc(ptr, nsize);
+}
+
+static void BM_ReusedInputs(tBenchmarkState* state)
+{
+	size_t allocated = 0, before;
+	lua_State* L = lua_newstate(CountingAlloc, &allocated);
+	const char* format = state->Arg ? "%+*d%+*z>%d" : "%*d%*z>%d";
+	int data[ARRAY_SIZE], i, res = 0;
+	char list[16 * 8 + 1];
+	luaL_openlibs(L);
+	for(i=0;i<ARRAY_SIZE;i++)
+		data[i] = i;
+	for(i=0;i<16;i++)
+		sprintf(list + i*8, "item%03d", i);
+	list[16 * 8] = 0;
+	/* The first call creates the reused tables */
+	SkipWithError(state, lua_genpcallA(L, "local t, z = ... return #t + #z", format, ARRAY_SIZE, data, 16 * 8, list, &res));
+	before = allocated;
+	while(!state->Error[0] && KeepRunning(state))
+		if(SkipWithError(state, lua_genpcallA(L, "local t, z = ... return #t + #z", format, ARRAY_SIZE, data, 16 * 8, list, &res)))
+			break;
+	if(res != ARRAY_SIZE + 16)
+		SkipWithError(state, "wrong length of the inputs");
+	state->Items = (double)state->Iterations;
+	SetCounter(state, "bytes_per_call", (double)(allocated - before) / (double)state->Iterations);
+	lua_close(L);
+}
+
+static void PushInteger(lua_State* L, const void* ptr)
+{
+	lua_pushinteger(L, *(const int*)ptr);
+}
+
+static void GetInteger(lua_State* L, int idx, void* ptr)
+{
+	*(int*)ptr = (int)lua_tointeger(L, idx);
+}
+
+static void BM_Callback(tBenchmarkState* state)
+{
+	lua_State* L = NewBenchmarkState();
+	int input = 42, output = 0;
+	while(KeepRunning(state))
+		if(SkipWithError(state, lua_genpcallA(L, "return ...", "%k>%k", PushInteger, &input, GetInteger, &output)))
+			break;
+	state->Items = (double)state->Iterations;
+	lua_close(L);
+}
+
+static void BM_ErrorPath(tBenchmarkState* state)
+{
+	lua_State* L = NewBenchmarkState();
+	while(KeepRunning(state))
+	{
+		if(lua_genpcallA(L, "error('failure')", "") == NULL)
+		{
+			SkipWithError(state, "the call did not fail");
+			break;
+		}
+		lua_settop(L, 0);
+	}
+	lua_close(L);
+}
+
+/* Rows streamed through %y by chunks of 16 to 65536 rows, generated by the callback.
+   The peak resident size of the process shows that the rows are never all in memory. */
+#define STREAMED_ROWS 10000000
+
+typedef struct
+{
+	int Id;
+	double Value;
+} tStreamedRow;
+
+static size_t GenerateRows(void* ud, void* rows, size_t maxrows)
+{
+	size_t* next = (size_t*)ud;
+	tStreamedRow* row = (tStreamedRow*)rows;
+	size_t i, nb = MIN(maxrows, STREAMED_ROWS - *next);
+	for(i=0;i<nb;i++,row++)
+	{
+		row->Id = (int)(*next + i);
+		row->Value = (double)((*next + i) % 100);
+	}
+	*next += nb;
+	return nb;
+}
+
+static void BM_Rows(tBenchmarkState* state)
+{
+	lua_State* L = NewBenchmarkState();
+	double sum = 0;
+	while(KeepRunning(state))
+	{
+		size_t next = 0;
+		if(SkipWithError(state, lua_genpcallA(L, "local s = 0 for id, value in ... do s = s + value end return s",
+			"%*y>%lf", (int)state->Arg, "%d %lf", GenerateRows, &next, &sum)))
+			break;
+	}
+	if(!state->Error[0] && sum != (double)(STREAMED_ROWS / 100) * 4950)
+		SkipWithError(state, "wrong sum of the rows");
+	state->Items = (double)state->Iterations * STREAMED_ROWS;
+#ifndef _WIN32
+	{
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		SetCounter(state, "ru_maxrss_kb", (double)usage.ru_maxrss);
+	}
+#endif
+	lua_close(L);
+}
+
+/* With the %F directive, the chunk is compiled again by each call */
+static void BM_ChunkCache(tBenchmarkState* state)
+{
+	lua_State* L = NewBenchmarkState();
+	const char* format = state->Arg ? ">%d" : "%F<>%d";
+	int res = 0;
+	while(KeepRunning(state))
+		if(SkipWithError(state, lua_genpcallA(L, "local t = {} for i = 1, 10 do t[i] = i end return #t", format, &res)))
+			break;
+	lua_close(L);
+}
+
+/* Latency of calls allocating garbage, with the collector running during the calls,
+   or stopped by %+*G and only run by 16 KB steps after each call. The latency of each
+   call goes into a histogram of 100 ns buckets, from which the percentiles are read. */
+#define LATENCY_BUCKETS 100000
+
+static double LatencyPercentile(const size_t* histogram, size_t total, double fraction)
+{
+	size_t i, count = 0, rank = (size_t)(fraction * (double)total);
+	for(i=0;i<LATENCY_BUCKETS;i++)
+	{
+		count += histogram[i];
+		if(count > rank)
+			break;
+	}
+	return (double)(i + 1) * 0.1;
+}
+
+static void BM_GcLatency(tBenchmarkState* state)
+{
+	static size_t histogram[LATENCY_BUCKETS];
+	static const char* script = "local t = {} for i = 1, 100 do t[i] = { i } end return #t";
+	const char* format = state->Arg ? "%+*G<>%d" : ">%d";
+	lua_State* L = NewBenchmarkState();
+	size_t bucket;
+	int res = 0;
+	memset(histogram, 0, sizeof(histogram));
+	while(KeepRunning(state))
+	{
+		double start = RealClock();
+		const char* error = state->Arg ? lua_genpcallA(L, script, format, 16, &res) : lua_genpcallA(L, script, format, &res);
+		if(SkipWithError(state, error))
+			break;
+		bucket = (size_t)((RealClock() - start) * 1e7);
+		histogram[MIN(bucket, LATENCY_BUCKETS - 1)]++;
+	}
+	state->Items = (double)state->Iterations;
+	SetCounter(state, "p50_us", LatencyPercentile(histogram, state->Iterations, 0.5));
+	SetCounter(state, "p99_us", LatencyPercentile(histogram, state->Iterations, 0.99));
+	SetCounter(state, "p999_us", LatencyPercentile(histogram, state->Iterations, 0.999));
+	lua_close(L);
+}
+
+/* Cost of the %P profiler at its default period, on a call running a Lua loop. The same
+   call without profiler is timed outside of the measure, just before, and the overhead is
+   the median of the ratios of the pairs, which ignores the pairs disturbed by the system. */
+#define PROFILER_PAIRS 4096
+
+static int CompareRatios(const void* a, const void* b)
+{
+	double ra = *(const double*)a, rb = *(const double*)b;
+	return ra < rb ? -1 : ra > rb;
+}
+
+static void BM_ProfilerOverhead(tBenchmarkState* state)
+{
+	static const char* script = "local function f(n) local x = 0 for i = 1, n do x = x + i % 7 end return x end return f(...)";
+	static double ratios[PROFILER_PAIRS];
+	lua_State* L = NewBenchmarkState();
+	double base, start;
+	char* stacks = NULL;
+	size_t nbpairs = 0;
+	int res = 0;
+	while(KeepRunning(state))
+	{
+		PauseTiming(state);
+		start = RealClock();
+		if(SkipWithError(state, lua_genpcallA(L, script, "%d>%d", 1000000, &res)))
+			break;
+		base = RealClock() - start;
+		ResumeTiming(state);
+		start = RealClock();
+		if(SkipWithError(state, lua_genpcallA(L, script, "%P<%d>%d", 1000000, &res)))
+			break;
+		if(nbpairs < PROFILER_PAIRS)
+			ratios[nbpairs++] = (RealClock() - start) / base;
+	}
+	lua_genpcallA(L, NULL, "%&P<", &stacks);
+	free(stacks);
+	qsort(ratios, nbpairs, sizeof(double), CompareRatios);
+	state->Items = (double)state->Iterations;
+	SetCounter(state, "overhead_percent", nbpairs ? (ratios[nbpairs / 2] - 1) * 100 : 0);
+	lua_close(L);
+}
+
+/* Warm-up of a pool of 64 states, each one running the same 16 scripts once. With
+   LGENCALL_USE_BYTECODE_STORE, the store is flushed before each pool, so that the scripts
+   are compiled by the first state and loaded from the store by the 63 others. */
+#define POOL_SCRIPTS 16
+
+static void BM_PoolWarmup(tBenchmarkState* state)
+{
+	static char scripts[POOL_SCRIPTS][512];
+	lgencall_storestats before, after;
+	lua_State** pool = (lua_State**)malloc(state->Arg * sizeof(lua_State*));
+	long i, j;
+	double misses = 0;
+	for(j=0;j<POOL_SCRIPTS;j++)
+		sprintf(scripts[j], "local n = ... local t = {} for i = 1, n do t[i] = { id = i, name = 'item' .. i, "
+			"value = i * %ld } end table.sort(t, function(a, b) return a.value > b.value end) "
+			"local s = 0 for _, v in ipairs(t) do s = s + v.value end return s", j + 1);
+	while(KeepRunning(state))
+	{
+		const char* error = NULL;
+		PauseTiming(state);
+		for(i=0;i<state->Arg;i++)
+			pool[i] = NewBenchmarkState();
+		lua_genpcallA(pool[0], NULL, "%#F %&F<", &before);
+		ResumeTiming(state);
+		for(i=0;i<state->Arg && error == NULL;i++)
+			for(j=0;j<POOL_SCRIPTS && error == NULL;j++)
+				error = lua_genpcallA(pool[i], scripts[j], "%d", 4);
+		PauseTiming(state);
+		lua_genpcallA(pool[0], NULL, "%&F<", &after);
+		misses += after.misses - before.misses;
+		for(i=0;i<state->Arg;i++)
+			lua_close(pool[i]);
+		ResumeTiming(state);
+		if(SkipWithError(state, error))
+			break;
+	}
+	free(pool);
+	state->Items = (double)state->Iterations * state->Arg;
+#if LGENCALL_USE_BYTECODE_STORE
+	SetCounter(state, "compilations_per_pool", state->Iterations ? misses / state->Iterations : 0);
+#else
+	(void)misses;
+#endif
+}
+
+#if LGENCALL_USE_THREADS
+/* Contention of 1 to 64 submitter threads on an executor of 4 worker states. Each
+   submitter sends 64 calls then waits for them. The submitters are started once,
+   and woken by a semaphore for each iteration. */
+#define SUBMIT_WORKERS 4
+#define SUBMIT_CALLS 64
+
+typedef struct
+{
+	lgencall_executor* Exec;
+	tSemaphore Start;
+	tSemaphore Done;
+	int fStop;
+	long NbErrors;
+} tSubmitters;
+
+#ifdef _WIN32
+static DWORD WINAPI SubmitterThread(LPVOID param)
+#else
+static void* SubmitterThread(void* param)
+#endif
+{
+	tSubmitters* s = (tSubmitters*)param;
+	lgencall_future* futures[SUBMIT_CALLS];
+	int i, results[SUBMIT_CALLS];
+	for(;;)
+	{
+		SemWait(&s->Start);
+		if(s->fStop)
+			break;
+		for(i=0;i<SUBMIT_CALLS;i++)
+			futures[i] = lua_gensubmitA(s->Exec, NULL, NULL, "return ... + 1", "%d>%d", i, &results[i]);
+		for(i=0;i<SUBMIT_CALLS;i++)
+		{
+			char* error = futures[i] ? lua_genwait(futures[i]) : NULL;
+			if(futures[i] == NULL || error)
+				ATOMIC_INCREMENT(&s->NbErrors);
+			free(error);
+		}
+		SemPost(&s->Done);
+	}
+	return 0;
+}
+
+static void BM_Submit(tBenchmarkState* state)
+{
+	lua_State* states[SUBMIT_WORKERS];
+	tThread* threads = (tThread*)malloc(state->Arg * sizeof(tThread));
+	tSubmitters s;
+	long i, nbthreads;
+	int fstart, fdone;
+	memset(&s, 0, sizeof(s));
+	for(i=0;i<SUBMIT_WORKERS;i++)
+		states[i] = NewBenchmarkState();
+	s.Exec = lua_genstart(states, SUBMIT_WORKERS);
+	fstart = SemInit(&s.Start);
+	fdone = SemInit(&s.Done);
+	for(nbthreads=0;s.Exec && fstart && fdone && nbthreads<state->Arg;nbthreads++)
+	{
+#ifdef _WIN32
+		threads[nbthreads] = CreateThread(NULL, 0, SubmitterThread, &s, 0, NULL);
+		if(threads[nbthreads] == NULL)
+#else
+		if(pthread_create(threads + nbthreads, NULL, SubmitterThread, &s))
+#endif
+			break;
+	}
+	if(nbthreads < state->Arg)
+		SkipWithError(state, "cannot start the threads");
+	else while(KeepRunning(state))
+	{
+		for(i=0;i<nbthreads;i++)
+			SemPost(&s.Start);
+		for(i=0;i<nbthreads;i++)
+			SemWait(&s.Done);
+	}
+	s.fStop = 1;
+	for(i=0;i<nbthreads;i++)
+		SemPost(&s.Start);
+	for(i=0;i<nbthreads;i++)
+	{
+#ifdef _WIN32
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+#else
+		pthread_join(threads[i], NULL);
+#endif
+	}
+	if(s.Exec)
+		lua_genstop(s.Exec);
+	for(i=0;i<SUBMIT_WORKERS;i++)
+		lua_close(states[i]);
+	if(fstart)
+		SemDestroy(&s.Start);
+	if(fdone)
+		SemDestroy(&s.Done);
+	free(threads);
+	if(s.NbErrors)
+		SkipWithError(state, "submitted call failed");
+	state->Items = (double)state->Iterations * state->Arg * SUBMIT_CALLS;
+}
+#endif
+
+/* Format parser alone, as used by genericcallA for the input and output elements */
+static const char* const ParserFormats[] =
+{
+	"%d%lf%b%s>%lf%b",
+	"%+*hz %#lz %2,3d %3:*lf %&*Ld > %!+s %#2,*:*hd",
+	"%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d"
+	"%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d",
+};
+
+static void BM_ParseFormat(tBenchmarkState* state)
+{
+	const char* format = ParserFormats[state->Arg];
+	lua_State* L = NewBenchmarkState();
+	tEnvironment env;
+	tElement element;
+	tDimension dims[MAX_DIMENSIONS];
+	size_t nbelements = 0;
+	memset(&env, 0, sizeof(tEnvironment));
+	env.L = L;
+	while(KeepRunning(state))
+	{
+		const char* pos = format;
+		while(*pos)
+		{
+			if(*pos == '>')
+			{
+				pos++;
+				continue;
+			}
+			memset(&element, 0, sizeof(tElement));
+			element.Dims = dims;
+			pos = GetNextElement(&env, pos, &element);
+			nbelements++;
+		}
+	}
+	state->Items = (double)nbelements;
+	state->Bytes = (double)state->Iterations * (double)strlen(format);
+	lua_close(L);
+}
+
+static void RegisterBenchmarks(void)
+{
+	char name[64];
+	int i;
+	RegisterBenchmark("BM_Scalars", BM_Scalars, 0);
+	RegisterBenchmark("BM_CallOverhead/lua_pcall", BM_CallOverhead, 0);
+	RegisterBenchmark("BM_CallOverhead/lua_genpcallA", BM_CallOverhead, 1);
+	RegisterBenchmark("BM_CallOverhead/lua_genpcallA_ref", BM_CallOverhead, 2);
+	RegisterBenchmark("BM_CallOverhead/lua_gencallA", BM_CallOverhead, 3);
+	RegisterBenchmark("BM_OutputChecks/strict", BM_OutputChecks, 0);
+	RegisterBenchmark("BM_OutputChecks/trusted", BM_OutputChecks, 1);
+	RegisterBenchmark("BM_StateStartup/all", BM_StateStartup, 0);
+	RegisterBenchmark("BM_StateStartup/base_string_math", BM_StateStartup, 1);
+	RegisterBenchmark("BM_StateStartup/preloaded", BM_StateStartup, 2);
+	RegisterBenchmark("BM_Arguments/1", BM_Arguments, 1);
+	RegisterBenchmark("BM_Arguments/8", BM_Arguments, 8);
+	RegisterBenchmark("BM_Arguments/64", BM_Arguments, 64);
+	RegisterBenchmark("BM_ParseFormat/scalars", BM_ParseFormat, 0);
+	RegisterBenchmark("BM_ParseFormat/arrays", BM_ParseFormat, 1);
+	RegisterBenchmark("BM_ParseFormat/64_elements", BM_ParseFormat, 2);
+	for(i=0;i<(int)(sizeof(ArrayTypes)/sizeof(ArrayTypes[0]));i++)
+	{
+		sprintf(name, "BM_InputArray/%s/%d", ArrayTypes[i].Name, ARRAY_SIZE);
+		RegisterBenchmark(name, BM_InputArray, i);
+		sprintf(name, "BM_OutputArray/%s/%d", ArrayTypes[i].Name, ARRAY_SIZE);
+		RegisterBenchmark(name, BM_OutputArray, i);
+	}
+	RegisterBenchmark("BM_OutputArraySize/1000", BM_OutputArraySize, 1000);
+	RegisterBenchmark("BM_OutputArraySize/100000", BM_OutputArraySize, 100000);
+	RegisterBenchmark("BM_OutputArraySize/1000000", BM_OutputArraySize, 1000000);
+	RegisterBenchmark("BM_OutputArraySize/10000000", BM_OutputArraySize, 10000000);
+	RegisterBenchmark("BM_String/16", BM_String, 16);
+	RegisterBenchmark("BM_String/4096", BM_String, 4096);
+#if LGENCALL_USE_WIDESTRING
+	RegisterBenchmark("BM_WideString/16", BM_WideString, 16);
+	RegisterBenchmark("BM_WideString/4096", BM_WideString, 4096);
+#endif
+	RegisterBenchmark("BM_StringList/16", BM_StringList, 16);
+	RegisterBenchmark("BM_ReusedInputs/new_tables", BM_ReusedInputs, 0);
+	RegisterBenchmark("BM_ReusedInputs/reused_tables", BM_ReusedInputs, 1);
+	RegisterBenchmark("BM_Callback", BM_Callback, 0);
+	RegisterBenchmark("BM_ErrorPath", BM_ErrorPath, 0);
+	for(i=16;i<=65536;i*=16)
+	{
+		sprintf(name, "BM_Rows/chunk:%d", i);
+		RegisterBenchmark(name, BM_Rows, i);
+	}
+	RegisterBenchmark("BM_ChunkCache/cold", BM_ChunkCache, 0);
+	RegisterBenchmark("BM_ChunkCache/warm", BM_ChunkCache, 1);
+	RegisterBenchmark("BM_GcLatency/collector", BM_GcLatency, 0);
+	RegisterBenchmark("BM_GcLatency/steps_after_call", BM_GcLatency, 1);
+	RegisterBenchmark("BM_ProfilerOverhead", BM_ProfilerOverhead, 0);
+	RegisterBenchmark("BM_PoolWarmup/64", BM_PoolWarmup, 64);
+#if LGENCALL_USE_THREADS
+	for(i=1;i<=64;i*=2)
+	{
+		sprintf(name, "BM_Submit/threads:%d", i);
+		RegisterBenchmark(name, BM_Submit, i);
+	}
+#endif
+}
+
+/*------------------------------------------------------------------------------
+   Main program
+------------------------------------------------------------------------------*/
+
+static const char* GetOption(const char* arg, const char* name)
+{
+	size_t len = strlen(name);
+	if(strncmp(arg, name, len) == 0 && arg[len] == '=')
+		return arg + len + 1;
+	return NULL;
+}
+
+static int MatchFilter(const char* filter, const char* name)
+{
+#ifdef _WIN32
+	return strstr(name, filter) != NULL;
+#else
+	regex_t re;
+	int res;
+	if(regcomp(&re, filter, REG_EXTENDED | REG_NOSUB))
+		return strstr(name, filter) != NULL;
+	res = regexec(&re, name, 0, NULL, 0) == 0;
+	regfree(&re);
+	return res;
+#endif
+}
+
+int main(int argc, char* argv[])
+{
+	const char *filter = NULL, *format = "console", *outname = NULL, *outformat = "json", *value;
+	tBenchmarkResult* results;
+	int i, nbresults = 0, flist = 0, nberrors = 0;
+	FILE* out = NULL;
+	for(i=1;i<argc;i++)
+	{
+		if((value = GetOption(argv[i], "--benchmark_filter")) != NULL)
+			filter = value;
+		else if((value = GetOption(argv[i], "--benchmark_min_time")) != NULL)
+			MinTime = atof(value);
+		else if((value = GetOption(argv[i], "--benchmark_format")) != NULL)
+			format = value;
+		else if((value = GetOption(argv[i], "--benchmark_out")) != NULL)
+			outname = value;
+		else if((value = GetOption(argv[i], "--benchmark_out_format")) != NULL)
+			outformat = value;
+		else if(strcmp(argv[i], "--benchmark_list_tests") == 0 || strcmp(argv[i], "--benchmark_list_tests=true") == 0)
+			flist = 1;
+		else
+		{
+			fprintf(stderr, "unrecognized option '%s'\n", argv[i]);
+			return 1;
+		}
+	}
+	RegisterBenchmarks();
+	if(flist)
+	{
+		for(i=0;i<NbBenchmarks;i++)
+			if(filter == NULL || MatchFilter(filter, Benchmarks[i].Name))
+				printf("%s\n", Benchmarks[i].Name);
+		return 0;
+	}
+	if(outname && (out = fopen(outname, "w")) == NULL)
+	{
+		fprintf(stderr, "cannot open '%s'\n", outname);
+		return 1;
+	}
+	results = (tBenchmarkResult*)calloc(NbBenchmarks, sizeof(tBenchmarkResult));
+	if(strcmp(format, "json"))
+		PrintConsoleHeader(stdout);
+	if(out && strcmp(outformat, "json"))
+		PrintConsoleHeader(out);
+	for(i=0;i<NbBenchmarks;i++)
+	{
+		tBenchmarkResult* res = results + nbresults;
+		if(filter && !MatchFilter(filter, Benchmarks[i].Name))
+			continue;
+		res->Benchmark = Benchmarks + i;
+		RunBenchmark(res->Benchmark, &res->State);
+		nberrors += res->State.Error[0] != 0;
+		if(strcmp(format, "json"))
+			PrintConsoleResult(stdout, res);
+		if(out && strcmp(outformat, "json"))
+			PrintConsoleResult(out, res);
+		fflush(stdout);
+		nbresults++;
+	}
+	if(strcmp(format, "json") == 0)
+		PrintJson(stdout, argv[0], results, nbresults);
+	if(out)
+	{
+		if(strcmp(outformat, "json") == 0)
+			PrintJson(out, argv[0], results, nbresults);
+		fclose(out);
+	}
+	free(results);
+	return nberrors != 0;
+}
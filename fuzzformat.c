@@ -0,0 +1,135 @@
+/* Fuzz target of the format parser GetNextElement, for libFuzzer:
+     clang -g -fsanitize=fuzzer,address,undefined -DLGENCALL_LIBFUZZER -Ilua/src fuzzformat.c lua/src/liblua.a -lm
+   The format is split into directive, input and output elements like in genericcallA,
+   within a protected call, so that errors are reported with luaL_error as usual.
+   Without LGENCALL_LIBFUZZER, a small driver replays the files given on the command line,
+   or else mutates the seed formats below with a fixed random sequence, so that the
+   target can also run as a test with compilers lacking libFuzzer. */
+
+#include "lgencall.c"
+
+static int ParseFormat(lua_State* L)
+{
+	const char* format = lua_tostring(L, 1);
+	tEnvironment env;
+	tElement element;
+	tDimension dims[MAX_DIMENSIONS];
+	memset(&env, 0, sizeof(tEnvironment));
+	env.L = L;
+	if(strchr(format, '<'))
+	{
+		while(*format != '<')
+		{
+			memset(&element, 0, sizeof(tElement));
+			format = GetNextElement(&env, format, &element);
+			if(element.NbDims != 0)
+				abort();
+		}
+		format++;
+	}
+	while(*format)
+	{
+		const char* next;
+		if(*format == '>')
+		{
+			format++;
+			continue;
+		}
+		memset(&element, 0, sizeof(tElement));
+		element.Dims = dims;
+		next = GetNextElement(&env, format, &element);
+		if(next <= format || next > format + strlen(format) || element.NbDims > MAX_DIMENSIONS)
+			abort();
+		format = next;
+	}
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	static lua_State* L = NULL;
+	char buffer[4096];
+	if(L == NULL)
+		L = luaL_newstate();
+	size = MIN(size, sizeof(buffer) - 1);
+	memcpy(buffer, data, size);
+	buffer[size] = 0;
+	lua_pushcfunction(L, ParseFormat);
+	lua_pushstring(L, buffer);
+	lua_pcall(L, 1, 0, 0);
+	lua_settop(L, 0);
+	return 0;
+}
+
+#ifndef LGENCALL_LIBFUZZER
+
+static const char* const Seeds[] =
+{
+	"%d%lf%b>%lf%b",
+	"%M %O %S %&M< %s > %+s %#s %*s %&hs",
+	"%2,3d %2:12,2d %3:*lf %*,*:*hd",
+	"%+*hz %#lz %*.2s %!d %&*Ld %hhu %lld",
+	"%B %*B %&H %T %P %X %G %+G %R %&R %E %W <",
+	"%y %2y %k %c %t %p %n %o %#o %2o",
+	"%%%% %d% %.%l %hhhd %LLf %5 %,d %:d %1::2d",
+	/* Overflowing widths, and too many dimensions */
+	"%20f %.99999999999999999999d %18446744073709551616d %4294967296,4294967296:4294967296d",
+	"%1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17d %*,*,*,*,*,*,*,*,*,*,*,*,*,*,*,*,*d",
+};
+
+static void RunFile(const char* name)
+{
+	static uint8_t data[1 << 16];
+	size_t size;
+	FILE* file = fopen(name, "rb");
+	if(file == NULL)
+	{
+		fprintf(stderr, "cannot open '%s'\n", name);
+		exit(1);
+	}
+	size = fread(data, 1, sizeof(data), file);
+	fclose(file);
+	LLVMFuzzerTestOneInput(data, size);
+}
+
+int main(int argc, char* argv[])
+{
+	static const char alphabet[] = "%%%%<>,:.*&#+!-0123456789hlLdfbsznkcptyoMOSFGHBRETPXWC ";
+	uint32_t seed = 12345;
+	uint8_t buffer[256];
+	static uint8_t large[2400];
+	int i, j;
+	if(argc > 1)
+	{
+		for(i=1;i<argc;i++)
+			RunFile(argv[i]);
+		return 0;
+	}
+	/* More than 512 elements, more than 256 of each direction */
+	for(i=0;i<(int)sizeof(large)/2;i++)
+		memcpy(large + 2*i, i == 600 ? ">>" : "%d", 2);
+	LLVMFuzzerTestOneInput(large, sizeof(large));
+	for(i=0;i<(int)(sizeof(Seeds)/sizeof(Seeds[0]));i++)
+		LLVMFuzzerTestOneInput((const uint8_t*)Seeds[i], strlen(Seeds[i]));
+	for(i=0;i<200000;i++)
+	{
+		const char* base = Seeds[i % (sizeof(Seeds)/sizeof(Seeds[0]))];
+		size_t size = strlen(base);
+		memcpy(buffer, base, size);
+		for(j=0;j<8;j++)
+		{
+			size_t pos;
+			seed = seed * 1103515245 + 12345;
+			pos = (seed >> 8) % (size + 1);
+			if(pos == size && size < sizeof(buffer))
+				size++;
+			buffer[pos] = (uint8_t)alphabet[(seed >> 20) % (sizeof(alphabet) - 1)];
+			if(seed & 0x80000000u)
+				buffer[pos] |= 0x80;
+		}
+		LLVMFuzzerTestOneInput(buffer, size);
+	}
+	return 0;
+}
+
+#endif
@@ -22,6 +22,14 @@
 * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 ******************************************************************************/
 
+/* Strict modes like -std=c99 hide clock_gettime and the other POSIX functions */
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#if defined(__APPLE__) && !defined(_DARWIN_C_SOURCE)
+#define _DARWIN_C_SOURCE   /* for SO_NOSIGPIPE */
+#endif
+#endif
+
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
@@ -29,15 +37,65 @@
 #include <ctype.h>
 #include <limits.h>
 #include <wchar.h>
+#include <stdio.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 #define LUA_LIB
 #include "lua.h"
 #include "llimits.h"
 #include "lauxlib.h"
 #include "lualib.h"
 #include "lgencall.h"
+#if LGENCALL_USE_FORK
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
+#if LGENCALL_USE_LUA_INTERNALS
+#include "lobject.h"
+#endif
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+#if LGENCALL_USE_THREADS
+#include <setjmp.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <sched.h>
+#include <semaphore.h>
+#endif
+#endif
+#if LGENCALL_USE_TRACE && defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define READ_TSC() __rdtsc()
+#elif LGENCALL_USE_TRACE && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define READ_TSC() __rdtsc()
+#else
+#define READ_TSC() GetMicroseconds()
+#endif
 
 #define COMPILED_TABLE "GenericCall_CompiledFct"
+#define INPUT_TABLES "GenericCall_InputTables"
+#define PROFILE_TABLE "GenericCall_Profile"
+#define MEMO_TABLE "GenericCall_Memo"
+#define ROWS_CHUNK_SIZE 256
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define MAX_DIMENSIONS 16
+#define DIM_FROM_ARGUMENT ((size_t)-1)
+#define HOOK_PERIOD 1000  /* instructions between two checks of the call budget */
+#define PROFILE_BUFFER "GenericCall_ProfileBuffer"
+#define PROFILE_PERIOD 1000  /* default microseconds between two stack samples */
+#define PROFILE_MAX_DEPTH 64
+#define PROFILE_BUFFER_SIZE 65536  /* samples of a state not yet counted in PROFILE_TABLE */
+#define MEMO_CAPACITY 256  /* default number of cached results */
+#define MEMO_BUCKETS 256
+#define MEMO_KEY_SIZE 256  /* keys up to this size are built without allocation */
+#define MEMO_MAX_OUTPUTS 16
 typedef enum 
 {
 	BT_NUMBER,
@@ -53,6 +111,8 @@ typedef enum
 	BT_FUNCTION,
 	BT_CALLBACK,
 	BT_STRUCTURE,
+	BT_ROWS,
+	BT_REFERENCE,
 } eBasicType;
 
 typedef enum 
@@ -64,6 +124,14 @@ typedef enum
 	DT_GET_STATE,
 	DT_CLEAR_CACHE,
 	DT_COLLECT_GARBAGE,
+	DT_FUNCTION_REF,
+	DT_EMIT,
+	DT_ERROR_REPORT,
+	DT_WORKER,
+	DT_BUDGET,
+	DT_PROFILE,
+	DT_TRACE,
+	DT_MEMO,
 } eDirectiveType;
 
 typedef enum
@@ -96,25 +164,86 @@ typedef enum
 	STATE_TYPE
 } eParserState;
 
+typedef enum
+{
+	CC_INVALID,
+	CC_SPACE,
+	CC_PERCENT,
+	CC_END,
+	CC_FLAG,
+	CC_WIDTH,
+	CC_DIGIT,
+	CC_DOT,
+	CC_MODIFIER,
+	CC_TYPE,
+	CC_DIRECTIVE,
+	CC_COMMA,
+	CC_COLON,
+	CC_TRUSTED
+} eCharClass;
+
+typedef struct
+{
+	uint8_t Class;
+	int8_t Value;
+} tCharClass;
+
 typedef struct
 {
 	va_list List;
+#if LGENCALL_USE_THREADS
+	const uint8_t* Block;  /* arguments copied by lua_gensubmitA, read in place of the list */
+	size_t Pos;
+#endif
 } tVaList;
 
+#if LGENCALL_USE_THREADS
+#define VA_ARG(marker, type) ((marker)->Block ? *(type*)NextArgument(marker, sizeof(type)) : va_arg((marker)->List, type))
+#define VA_START(marker, last) ((marker).Block = NULL, va_start((marker).List, last))
+#define VA_COPY(dst, src) ((dst).Block = (src).Block, (dst).Pos = (src).Pos, \
+                           (dst).Block ? (void)0 : (void)va_copy((dst).List, (src).List))
+#define VA_END(marker) ((marker).Block ? (void)0 : (void)va_end((marker).List))
+
+/* Target of the format errors raised without a state, while lua_gensubmitA copies the arguments */
+typedef struct tEscape
+{
+	jmp_buf Jump;
+	char Message[128];
+} tEscape;
+#else
+#define VA_ARG(marker, type) va_arg((marker)->List, type)
+#define VA_START(marker, last) va_start((marker).List, last)
+#define VA_COPY(dst, src) va_copy((dst).List, (src).List)
+#define VA_END(marker) va_end((marker).List)
+#endif
+
+/* Dimension of a multi-dimensional or strided array: number of elements,
+   and distance in bytes between two consecutive elements */
 typedef struct
 {
-	unsigned int Width;
+	size_t Count;
+	size_t Stride;
+} tDimension;
+
+/* Element descriptor: sizes and counts first, then pointers, then byte wide
+   fields, so that it fits in 56 bytes on 64 bits platforms */
+typedef struct
+{
+	size_t Width;
+	size_t Precision;
 	void* Pointer;
 	void* Pointer2;
-	eBasicType Type            : 5;
-	eDirectiveType EnvType     : 4;
-	eDirection Direction       : 2;
-	eAllocateMode AllocateMode : 3;
-	eWidthMode WidthMode       : 3;
-	eWidthMode PrecisionMode   : 3;
-	int TypeModifier           : 3;
-	unsigned int Precision     : 4;
-	unsigned int ArgumentNb    : 9;
+	tDimension* Dims;
+	unsigned int ArgumentNb;
+	eBasicType Type            : 8;
+	eDirectiveType EnvType     : 8;
+	eDirection Direction       : 8;
+	eAllocateMode AllocateMode : 8;
+	eWidthMode WidthMode       : 8;
+	eWidthMode PrecisionMode   : 8;
+	int TypeModifier           : 8;
+	unsigned int NbDims        : 8;
+	unsigned int fTrusted      : 1; /* output value converted without type check */
 } tElement;
 
 typedef struct 
@@ -125,18 +254,70 @@ typedef struct
 	int8_t Modifier;
 } tTypeSize;
 
-typedef struct
+struct tMemoCall;
+struct tEscape;
+struct tProfileBuffer;
+struct tRowIterator;
+
+typedef struct tEnvironment
 {
 	lua_State* L;
 	lua_Alloc AllocFct;
 	void* AllocUd;
 	tElement* Elements;
 	int NbElements;
+	int FunctionRef;
+	int* pFunctionRef;
+	lgencall_emitCB EmitFct;
+	void* EmitUd;
+	tElement* Outputs;
+	int NbOutputs;
+	int IdxFunction;
+	lgencall_error* Error;
+	int ErrorCode;       /* error code if an error occurs at this point of the call */
+	int ArgumentNb;
+	eDirection Direction;
+	int WorkerFd;
+	size_t GcStepSize;   /* in KB, 0 for a basic step */
+	size_t GcBudget;     /* in microseconds, 0 for a single step */
+	lgencall_gcstats* GcStats;
+	size_t InstructionBudget;
+	size_t TimeBudget;   /* in microseconds */
+	uint64_t Deadline;
+	size_t Executed;
+	size_t ProfilePeriod; /* in microseconds */
+	uint64_t ProfileDue;
+	struct tEnvironment* ProfileNext;  /* in the list of the profiler thread */
+	struct tProfileBuffer* ProfileBuffer;
+	size_t ProfileStart; /* first sample of the call in the buffer */
+	int fSampleDue;      /* set by the profiler thread, under ProfileLock */
+	char** ProfileExport; /* filled after the call by %&P */
+	const char* Script;  /* key of the profiler samples */
+	struct tRowIterator* RowIterators; /* ended after the call */
+	uint32_t TraceDepth; /* phases of the tracer open before the call */
+	int HookCount;
+	lua_Hook PrevHook;   /* hook and its environment replaced during the call */
+	int PrevHookMask;
+	int PrevHookCount;
+	void* PrevHookEnv;
+	size_t MemoCapacity;
+	size_t MemoTtl;      /* in milliseconds, 0 for no expiration */
+	lgencall_memostats* MemoStats;
+	struct tMemoCall* Memo;
+	struct tEscape* Escape;
 	uint8_t fWideChar   : 1;
 	uint8_t fOpenState  : 1;
 	uint8_t fCloseState : 1;
 	uint8_t fNeedRestart: 1;
 	uint8_t fRestarted  : 1;
+	uint8_t fFunctionRef: 1;
+	uint8_t fProtected  : 1;
+	uint8_t fWorker     : 1;
+	uint8_t fGcSteps    : 1;
+	uint8_t fGcStopped  : 1;
+	uint8_t fHooked     : 1;
+	uint8_t fProfiled   : 1;
+	uint8_t fMemo       : 1;
 } tEnvironment;
 
 typedef struct 
@@ -179,6 +360,7 @@ static const tTypeSize TypeSizes[] =
 	{ BT_STRING, BT_STRING_LIST, sizeof(wchar_t),     2 },
 #endif
 	{ BT_STRING, BT_STRING_LIST, sizeof(char),       -1 },
+	{ BT_REFERENCE, BT_REFERENCE, sizeof(int),       0 },
 };
 
 static void* MemoryAllocate(const tEnvironment* penv, size_t size)
@@ -186,152 +368,215 @@ static void* MemoryAllocate(const tEnvironment* penv, size_t size)
 	return (*penv->AllocFct)(penv->AllocUd, NULL, 0, size);
 }
 
+/* Character classes of the format parser, indexed by ASCII code.
+   The value is the digit, flag, width mode, type modifier increment,
+   basic type or directive type associated with the character. */
+static const tCharClass CharClasses[128] =
+{
+	{ CC_END, 0 },                        { CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_INVALID, 0 }, /* 00 */
+	{ CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_INVALID, 0 }, /* 04 */
+	{ CC_INVALID, 0 },                    { CC_SPACE, 0 },                      { CC_SPACE, 0 },                      { CC_INVALID, 0 }, /* 08 */
+	{ CC_INVALID, 0 },                    { CC_SPACE, 0 },                      { CC_INVALID, 0 },                    { CC_INVALID, 0 }, /* 0C */
+	{ CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_INVALID, 0 }, /* 10 */
+	{ CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_INVALID, 0 }, /* 14 */
+	{ CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_INVALID, 0 }, /* 18 */
+	{ CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_INVALID, 0 }, /* 1C */
+	{ CC_SPACE, 0 },                      { CC_TRUSTED, 0 },                    { CC_INVALID, 0 },                    { CC_FLAG, MODE_ALLOCATE }, /* 20 */
+	{ CC_INVALID, 0 },                    { CC_PERCENT, 0 },                    { CC_WIDTH, WIDTH_TO_OUTPUT },        { CC_INVALID, 0 }, /* 24 */
+	{ CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_WIDTH, WIDTH_FROM_ARGUMENT },    { CC_FLAG, MODE_FROM_STACK }, /* 28 */
+	{ CC_COMMA, 0 },                      { CC_INVALID, 0 },                    { CC_DOT, 0 },                        { CC_INVALID, 0 }, /* 2C */
+	{ CC_DIGIT, 0 },                      { CC_DIGIT, 1 },                      { CC_DIGIT, 2 },                      { CC_DIGIT, 3 }, /* 30 */
+	{ CC_DIGIT, 4 },                      { CC_DIGIT, 5 },                      { CC_DIGIT, 6 },                      { CC_DIGIT, 7 }, /* 34 */
+	{ CC_DIGIT, 8 },                      { CC_DIGIT, 9 },                      { CC_COLON, 0 },                      { CC_INVALID, 0 }, /* 38 */
+	{ CC_END, 0 },                        { CC_INVALID, 0 },                    { CC_END, 0 },                        { CC_INVALID, 0 }, /* 3C */
+	{ CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_DIRECTIVE, DT_BUDGET },          { CC_DIRECTIVE, DT_CLOSE_STATE }, /* 40 */
+	{ CC_INVALID, 0 },                    { CC_DIRECTIVE, DT_EMIT },            { CC_DIRECTIVE, DT_CLEAR_CACHE },     { CC_DIRECTIVE, DT_COLLECT_GARBAGE }, /* 44 */
+	{ CC_DIRECTIVE, DT_MEMO },            { CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_INVALID, 0 }, /* 48 */
+	{ CC_MODIFIER, 2 },                   { CC_DIRECTIVE, DT_MEMORY_ALLOC },    { CC_INVALID, 0 },                    { CC_DIRECTIVE, DT_OPEN_LIBRARY }, /* 4C */
+	{ CC_DIRECTIVE, DT_PROFILE },         { CC_INVALID, 0 },                    { CC_DIRECTIVE, DT_FUNCTION_REF },    { CC_DIRECTIVE, DT_GET_STATE }, /* 50 */
+	{ CC_DIRECTIVE, DT_TRACE },           { CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_DIRECTIVE, DT_WORKER }, /* 54 */
+	{ CC_DIRECTIVE, DT_ERROR_REPORT },    { CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_INVALID, 0 }, /* 58 */
+	{ CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_INVALID, 0 }, /* 5C */
+	{ CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_TYPE, BT_BOOLEAN },              { CC_TYPE, BT_FUNCTION }, /* 60 */
+	{ CC_TYPE, BT_INTEGER },              { CC_INVALID, 0 },                    { CC_TYPE, BT_NUMBER },               { CC_INVALID, 0 }, /* 64 */
+	{ CC_MODIFIER, -1 },                  { CC_TYPE, BT_INTEGER },              { CC_INVALID, 0 },                    { CC_TYPE, BT_CALLBACK }, /* 68 */
+	{ CC_MODIFIER, 1 },                   { CC_INVALID, 0 },                    { CC_TYPE, BT_NIL },                  { CC_TYPE, BT_REFERENCE }, /* 6C */
+	{ CC_TYPE, BT_LIGHT_POINTER },        { CC_INVALID, 0 },                    { CC_TYPE, BT_STRUCTURE },            { CC_TYPE, BT_STRING }, /* 70 */
+	{ CC_TYPE, BT_THREAD },               { CC_TYPE, BT_UNSIGNED },             { CC_INVALID, 0 },                    { CC_INVALID, 0 }, /* 74 */
+	{ CC_INVALID, 0 },                    { CC_TYPE, BT_ROWS },                 { CC_TYPE, BT_STRING_LIST },          { CC_INVALID, 0 }, /* 78 */
+	{ CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_INVALID, 0 },                    { CC_INVALID, 0 }, /* 7C */
+};
+
+#if LGENCALL_USE_THREADS
+/* Arguments are aligned on 8 bytes, or 16 bytes for the larger ones like long double */
+static size_t AlignArgument(size_t pos, size_t size)
+{
+	size_t align = size > 8 ? 16 : 8;
+	return (pos + align - 1) & ~(align - 1);
+}
+
+static const void* NextArgument(tVaList* marker, size_t size)
+{
+	const void* arg;
+	marker->Pos = AlignArgument(marker->Pos, size);
+	arg = marker->Block + marker->Pos;
+	marker->Pos += size;
+	return arg;
+}
+#endif
+
+/* luaL_error for the format parser, which also runs without a state in lua_gensubmitA */
+static void FormatError(const tEnvironment* penv, const char* fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+#if LGENCALL_USE_THREADS
+	if(penv->L == NULL)
+	{
+		vsnprintf(penv->Escape->Message, sizeof(penv->Escape->Message), fmt, args);
+		va_end(args);
+		longjmp(penv->Escape->Jump, 1);
+	}
+#endif
+	luaL_where(penv->L, 1);
+	lua_pushvfstring(penv->L, fmt, args);
+	va_end(args);
+	lua_concat(penv->L, 2);
+	lua_error(penv->L);
+}
+
 static const char* GetNextElement(const tEnvironment* penv, const char* format, 
 								   tElement* element)
 {
-	eParserState state = STATE_START, laststate = STATE_FLAGS;
+	eParserState state = STATE_START;
+	size_t* pvalue = &element->Width; /* width, or count or stride of the current dimension */
 	for(;;)
 	{
-		char car = *format++;
-		if(car == ' ' || car == '\t' || car == '\n' || car == '\r')
-			continue; /* Allow spaces on format string, for clarity */
-		switch(state)
+		unsigned char car = (unsigned char)*format++;
+		const tCharClass* cc = &CharClasses[car & 0x7F];
+		if(car & 0x80)
+			FormatError(penv, "unexpected non ASCII character in format near '%s'", format - 1);
+		switch(cc->Class)
 		{
-		case STATE_START:
-			if(car == '%')
+		case CC_SPACE:
+			continue; /* Allow spaces on format string, for clarity */
+		case CC_PERCENT:
+			if(state == STATE_START)
+			{
 				state = STATE_FLAGS;
-			else
-				luaL_error(penv->L, "unexpected character %c", car);
+				continue;
+			}
+			/* fallthrough - '%' ends the previous element */
+		case CC_END:
+			if(state == STATE_TYPE)
+				return format - 1;
+			if(state != STATE_START)
+				FormatError(penv, "missing type character near '%s'", format - 1);
 			break;
-		case STATE_FLAGS:
-			switch(car)
-			{
-			case '#':
-				element->AllocateMode = MODE_ALLOCATE;
-				break;
-			case '+':
-				element->AllocateMode = MODE_FROM_STACK;
+		case CC_FLAG:
+			if(state != STATE_FLAGS)
 				break;
-			default:
-				state = STATE_WIDTH;
+			element->AllocateMode = (eAllocateMode)cc->Value;
+			continue;
+		case CC_TRUSTED:
+			if(state != STATE_FLAGS)
 				break;
+			element->fTrusted = 1;
+			continue;
+		case CC_WIDTH:
+			if(state == STATE_PRECISION && cc->Value == WIDTH_FROM_ARGUMENT)
+			{
+				element->PrecisionMode = WIDTH_FROM_ARGUMENT;
+				continue;
 			}
-			break;
-		case STATE_WIDTH:
-			if(car == '*')
-				element->WidthMode = WIDTH_FROM_ARGUMENT;
-			else if(car == '&')
-				element->WidthMode = WIDTH_TO_OUTPUT;
-			else if(isdigit((int)car))
-				element->Width = element->Width * 10 + car - '0';
-			else
-				state = STATE_PRECISION;
-			break;
-		case STATE_PRECISION:
-			if(car == '.')
+			if(state != STATE_FLAGS && state != STATE_WIDTH)
 				break;
-			if(car == '*')
-				element->PrecisionMode = WIDTH_FROM_ARGUMENT;
-			else if(isdigit((int)car))
-				element->Precision = element->Precision * 10 + car - '0';
+			if(element->NbDims == 0)
+				element->WidthMode = (eWidthMode)cc->Value;
+			else if(cc->Value == WIDTH_FROM_ARGUMENT && *pvalue == 0)
+				*pvalue = DIM_FROM_ARGUMENT;
 			else
-				state = STATE_PREFIX;
-			break;
-		case STATE_PREFIX:
-			switch(car)
+				FormatError(penv, "invalid array shape near '%s'", format - 1);
+			state = STATE_WIDTH;
+			continue;
+		case CC_DIGIT:
+			if(state == STATE_FLAGS || state == STATE_WIDTH)
 			{
-			case 'L':
-				element->TypeModifier += 2;
-				break;
-			case 'l':
-				element->TypeModifier++;
+				if(*pvalue > ((size_t)-1 - cc->Value) / 10)
+					FormatError(penv, "width too large near '%s'", format - 1);
+				*pvalue = *pvalue * 10 + cc->Value;
+				state = STATE_WIDTH;
+				continue;
+			}
+			if(state != STATE_PRECISION)
 				break;
-			case 'h':
-				element->TypeModifier--;
+			if(element->Precision > ((size_t)-1 - cc->Value) / 10)
+				FormatError(penv, "precision too large near '%s'", format - 1);
+			element->Precision = element->Precision * 10 + cc->Value;
+			continue;
+		case CC_DOT:
+			if(state != STATE_FLAGS && state != STATE_WIDTH)
 				break;
-			default:
-				state = STATE_TYPE;
+			state = STATE_PRECISION;
+			continue;
+		case CC_COMMA:
+		case CC_COLON:
+			if(state != STATE_WIDTH)
 				break;
+			if(element->Dims == NULL || element->WidthMode == WIDTH_TO_OUTPUT)
+				FormatError(penv, "array shape not allowed near '%s'", format - 1);
+			if(element->NbDims == 0)
+			{
+				/* The width read so far becomes the first dimension */
+				element->Dims[0].Count = element->WidthMode == WIDTH_FROM_ARGUMENT ? DIM_FROM_ARGUMENT : element->Width;
+				element->Dims[0].Stride = 0;
+				element->NbDims = 1;
+				element->WidthMode = WIDTH_FROM_FORMAT;
+				element->Width = 0;
 			}
-			break;
-		case STATE_TYPE:
-			switch(car)
+			if(cc->Class == CC_COLON)
 			{
-			case 'f':
-				element->Type = BT_NUMBER;
-				break;
-			case 'd':
-			case 'i':
-				element->Type = BT_INTEGER;
-				break;
-			case 'u':
-				element->Type = BT_UNSIGNED;
-				break;
-			case 'p':
-				if(element->TypeModifier > 0)
-					element->Type = BT_FULL_POINTER;
-				else
-					element->Type = BT_LIGHT_POINTER;
-				break;
-			case 's':
-				element->Type = BT_STRING;
-				if(element->TypeModifier == 0)
-					element->TypeModifier = penv->fWideChar;
-				break;
-			case 'b':
-				element->Type = BT_BOOLEAN;
-				break;
-			case 't':
-				element->Type = BT_THREAD;
-				break;
-			case 'c':
-				element->Type = BT_FUNCTION;
-				break;
-			case 'n':
-				element->Type = BT_NIL;
-				break;
-			case 'k':
-				element->Type = BT_CALLBACK;
-				break;
-			case 'r':
-				element->Type = BT_STRUCTURE;
-				break;
-			case 'z':
-				element->Type = BT_STRING_LIST;
-				if(element->TypeModifier == 0)
-					element->TypeModifier = penv->fWideChar;
-				break;
-			case 'M':
-				element->EnvType = DT_MEMORY_ALLOC;
-				break;
-			case 'O':
-				element->EnvType = DT_OPEN_LIBRARY;
-				break;
-			case 'S':
-				element->EnvType = DT_GET_STATE;
-				break;
-			case 'C':
-				element->EnvType = DT_CLOSE_STATE;
+				if(pvalue == &element->Dims[element->NbDims-1].Stride)
+					FormatError(penv, "invalid array shape near '%s'", format - 1);
+				pvalue = &element->Dims[element->NbDims-1].Stride;
+				continue;
+			}
+			if(element->NbDims == MAX_DIMENSIONS)
+				FormatError(penv, "too many array dimensions near '%s'", format - 1);
+			pvalue = &element->Dims[element->NbDims].Count;
+			element->Dims[element->NbDims].Stride = 0;
+			element->NbDims++;
+			*pvalue = 0;
+			continue;
+		case CC_MODIFIER:
+			if(state == STATE_START || state == STATE_TYPE)
 				break;
-			case 'F':
-				element->EnvType = DT_CLEAR_CACHE;
+			if(abs(element->TypeModifier + cc->Value) > 2)
+				FormatError(penv, "too many type modifiers near '%s'", format - 1);
+			element->TypeModifier += cc->Value;
+			state = STATE_PREFIX;
+			continue;
+		case CC_TYPE:
+			if(state == STATE_START || state == STATE_TYPE)
 				break;
-			case 'G':
-				element->EnvType = DT_COLLECT_GARBAGE;
+			element->Type = (eBasicType)cc->Value;
+			if(element->Type == BT_LIGHT_POINTER && element->TypeModifier > 0)
+				element->Type = BT_FULL_POINTER;
+			else if((element->Type == BT_STRING || element->Type == BT_STRING_LIST) && 
+				    element->TypeModifier == 0)
+				element->TypeModifier = penv->fWideChar;
+			state = STATE_TYPE;
+			continue;
+		case CC_DIRECTIVE:
+			if(state == STATE_START || state == STATE_TYPE)
 				break;
-			case '%':
-			case '>':
-			case '<':
-			case '\0':
-				return format - 1;
-			default:
-				luaL_error(penv->L, "Invalid type character '%c' near '%s'", car, format);
-					break;
-			}
+			element->EnvType = (eDirectiveType)cc->Value;
+			state = STATE_TYPE;
+			continue;
 		}
-		if(state != laststate)
-			format--;
-		laststate = state;
+		if(state == STATE_START)
+			FormatError(penv, "unexpected character %c", car);
+		FormatError(penv, "Invalid type character '%c' near '%s'", car, format);
 	}
 }
 
@@ -426,6 +671,38 @@ static void LuaStringToWideString(lua_State* L, int idx)
 	lua_replace(L, idx-(idx<0));
 }
 
+/* Converts without raising errors into a caller buffer: invalid sequences become '?' */
+static void WideBufferFromString(const char* str, size_t len, wchar_t* dst, size_t size)
+{
+	const char* strend = str + len;
+	wchar_t* dstend = dst + size - 1;
+	while(str < strend && dst < dstend)
+	{
+		unsigned char car = (unsigned char)*str++;
+		uint32_t value = car;
+		int i, mask;
+		if(car & 0x80)
+		{
+			for(i=1,mask=0x40;car & mask;i++,mask>>=1);
+			value = car & (mask - 1);
+			for(;i>1 && str < strend && (*str & 0xC0) == 0x80;i--)
+				value = (value << 6) | (*str++ & 0x3F);
+			if(i != 1 || mask == 0x40 || value > 0x10FFFF)
+				value = '?';
+		}
+		if(sizeof(wchar_t) == 2 && value >= 0x10000)
+		{
+			if(dst + 1 == dstend)
+				break;
+			value -= 0x10000;
+			*dst++ = (wchar_t)(0xD800 | (value >> 10));
+			value = 0xDC00 | (value & 0x3FF);
+		}
+		*dst++ = (wchar_t)value;
+	}
+	*dst = 0;
+}
+
 #elif LGENCALL_USE_WIDESTRING == 1
 
 static void PushWideString(lua_State* L, const wchar_t* wstr, size_t len)
@@ -473,7 +750,167 @@ static void LuaStringToWideString(lua_State* L, int idx)
 	lua_replace(L, idx-(idx<0));
 }
 
+/* Converts without raising errors into a caller buffer: invalid characters become '?' */
+static void WideBufferFromString(const char* str, size_t len, wchar_t* dst, size_t size)
+{
+	wchar_t* dstend = dst + size - 1;
+	size_t pos = 0;
+	while(pos < len && dst < dstend)
+	{
+		int res = mbtowc(dst, str+pos, len-pos);
+		if(res <= 0)
+		{
+			*dst = L'?';
+			res = 1;
+		}
+		dst++;
+		pos += res;
+	}
+	*dst = 0;
+}
+
+#endif
+
+static int IsArrayElement(const tElement* pelem)
+{
+	return (pelem->Width || pelem->NbDims) && pelem->Type != BT_STRING && pelem->Type != BT_STRING_LIST;
+}
+
+/* lua_rawgeti and lua_rawseti, for indices that may not fit in an int */
+static void RawGetIndex(lua_State* L, int idx, size_t n)
+{
+	if(n <= INT_MAX)
+		lua_rawgeti(L, idx, (int)n);
+	else
+	{
+		lua_pushnumber(L, (lua_Number)n);
+		lua_rawget(L, idx < 0 && idx > LUA_REGISTRYINDEX ? idx - 1 : idx);
+	}
+}
+
+static void RawSetIndex(lua_State* L, int idx, size_t n)
+{
+	if(n <= INT_MAX)
+		lua_rawseti(L, idx, (int)n);
+	else
+	{
+		lua_pushnumber(L, (lua_Number)n);
+		lua_insert(L, -2);
+		lua_rawset(L, idx < 0 && idx > LUA_REGISTRYINDEX ? idx - 1 : idx);
+	}
+}
+
+/* Pushes the table kept in the registry for an input argument of the called function,
+   so that it can be filled again instead of creating a new table on each call */
+static void PushReusedTable(const tEnvironment* penv, const tElement* pelem)
+{
+	lua_State* L = penv->L;
+	luaL_checkstack(L, 4, NULL);
+	lua_getfield(L, LUA_REGISTRYINDEX, INPUT_TABLES);
+	if(!lua_istable(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_createtable(L, 0, 0);
+		lua_createtable(L, 0, 1);
+		lua_pushliteral(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, INPUT_TABLES);
+	}
+	lua_pushvalue(L, penv->IdxFunction);
+	lua_rawget(L, -2);
+	if(!lua_istable(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_createtable(L, 0, 0);
+		lua_pushvalue(L, penv->IdxFunction);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -4);
+	}
+	lua_rawgeti(L, -1, pelem->ArgumentNb);
+	if(!lua_istable(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_createtable(L, IsArrayElement(pelem) ? (int)MIN(pelem->Width, INT_MAX) : 0, 0);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, -3, pelem->ArgumentNb);
+	}
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+}
+
+/* Removes the elements left by a previous call from a reused table on top of the stack */
+static void TrimReusedTable(lua_State* L, const tElement* pelem, size_t count)
+{
+	size_t i, len;
+	if(pelem->AllocateMode != MODE_FROM_STACK)
+		return;
+	len = lua_objlen(L, -1);
+	for(i=count+1;i<=len;i++)
+	{
+		lua_pushnil(L);
+		RawSetIndex(L, -2, i);
+	}
+}
+
+/* Length in characters of an element of a string list, stopping after maxlen characters */
+static size_t StringListItemLength(const char* psrc, size_t maxlen, size_t size)
+{
+	const char* pend;
+#if LGENCALL_USE_WIDESTRING
+	if(size == sizeof(wchar_t))
+	{
+		const wchar_t* pwend;
+		if(maxlen == (size_t)-1)
+			return wcslen((const wchar_t*)psrc);
+		pwend = wmemchr((const wchar_t*)psrc, 0, maxlen);
+		return pwend ? (size_t)(pwend - (const wchar_t*)psrc) : maxlen;
+	}
+#endif
+	if(maxlen == (size_t)-1)
+		return strlen(psrc);
+	pend = (const char*)memchr(psrc, 0, maxlen);
+	return pend ? (size_t)(pend - psrc) : maxlen;
+}
+
+/* Pushes a table with the elements of a zero separated string list, directly from the C data.
+   Without width, the list ends with an empty string; otherwise after Width characters. */
+static void PushStringList(lua_State* L, const char* psrc, const tElement* pelem)
+{
+	int pass;
+	size_t i, len, remain, count = 0, size = pelem->Precision;
+	const char* pos;
+	const char* pend = pelem->Width ? psrc + pelem->Width * size : NULL;
+	luaL_checkstack(L, 2, NULL);
+	for(pass=0;pass<2;pass++)
+	{
+		if(pass == 1 && pelem->AllocateMode != MODE_FROM_STACK)
+			lua_createtable(L, (int)MIN(count, INT_MAX), 0);
+		for(i=0,pos=psrc;;i++)
+		{
+			remain = pend ? (size_t)(pend - pos) / size : (size_t)-1;
+			if(remain == 0)
+				break;
+			len = StringListItemLength(pos, remain, size);
+			if(len == 0 && pend == NULL)
+				break;
+			if(pass == 1)
+			{
+#if LGENCALL_USE_WIDESTRING
+				if(size == sizeof(wchar_t) && len)
+					PushWideString(L, (const wchar_t*)pos, len);
+				else
 #endif
+					lua_pushlstring(L, pos, len * size);
+				RawSetIndex(L, -2, i+1);
+			}
+			pos += (len + (len < remain)) * size;
+		}
+		count = i;
+	}
+	TrimReusedTable(L, pelem, count);
+}
 
 static void PushValueByPointer(lua_State* L, const void* ptr, tElement* pelem)
 {
@@ -487,10 +924,11 @@ static void PushValueByPointer(lua_State* L, const void* ptr, tElement* pelem)
 		else if(pelem->Precision == sizeof(double))
 			lua_pushnumber(L, *(const double*)ptr);
 #if LGENCALL_USE_LONG_DOUBLE
-		else
-			lua_pushnumber(L, *(const long double*)ptr);
+		else if(pelem->Precision == sizeof(long double))
+			lua_pushnumber(L, (lua_Number)*(const long double*)ptr);
 #endif
-		lua_pushnumber(L, val);
+		else
+			luaL_error(L, "unknown floating precision %d", (int)pelem->Precision);
 		break;
 	case BT_UNSIGNED:
 		switch(pelem->Precision)
@@ -501,7 +939,7 @@ static void PushValueByPointer(lua_State* L, const void* ptr, tElement* pelem)
 #if LGENCALL_USE_64_BITS > 1
 		case 8: val = (lua_Number)*(const uint64_t*)ptr; break;
 #endif
-		default: luaL_error(L, "unknown unsigned precision %d", pelem->Precision); break;
+		default: luaL_error(L, "unknown unsigned precision %d", (int)pelem->Precision); break;
 		}
 		lua_pushnumber(L, val);
 		break;
@@ -515,7 +953,7 @@ static void PushValueByPointer(lua_State* L, const void* ptr, tElement* pelem)
 #if LGENCALL_USE_64_BITS
 		case 8: val = (lua_Number)*(const int64_t*)ptr; break;
 #endif
-		default: luaL_error(L, "unknown integer precision %d", pelem->Precision); break;
+		default: luaL_error(L, "unknown integer precision %d", (int)pelem->Precision); break;
 		}
 		if(pelem->Type == BT_INTEGER)
 			lua_pushnumber(L, val);
@@ -523,40 +961,8 @@ static void PushValueByPointer(lua_State* L, const void* ptr, tElement* pelem)
 			lua_pushboolean(L, (int)val);
 		break;
 	case BT_STRING_LIST:
-	{
-		int i;
-		int target = 2 * pelem->Precision;
-		size_t len;
-		const char* psrc = *(const char**)ptr;
-		if(pelem->Width == 0)
-		{
-			int cnt0 = 0;
-			for(i=0;cnt0!=target;i++)
-			{
-				if(psrc[i])
-					cnt0 = 0;
-				else
-					cnt0++;
-			}
-			pelem->Width = (i - 1) / pelem->Precision;
-		}
-		pelem->Type = BT_STRING;
-		PushValueByPointer(L, ptr, pelem);
-		pelem->Type = BT_STRING_LIST;
-		psrc = lua_tolstring(L, -1, &len);
-		lua_createtable(L, 0, 0);
-		i = 0;
-		while(len)
-		{
-			size_t s = strlen(psrc);
-			lua_pushlstring(L, psrc, s);
-			len -= s + 1;
-			psrc += s + 1;
-			lua_rawseti(L, -2, ++i);
-		}
-		lua_remove(L, -2);
+		PushStringList(L, *(const char**)ptr, pelem);
 		break;
-	}
 	case BT_STRING:
 #if LGENCALL_USE_WIDESTRING
 		if(pelem->Precision == sizeof(wchar_t))
@@ -596,121 +1002,117 @@ static void PushValueByPointer(lua_State* L, const void* ptr, tElement* pelem)
 	case BT_CALLBACK:
 		(*(lgencall_pushCB)pelem->Pointer2)(L, ptr);
 		break;
+	case BT_REFERENCE:
+		lua_rawgeti(L, LUA_REGISTRYINDEX, *(const int*)ptr);
+		if(pelem->AllocateMode == MODE_ALLOCATE)
+			luaL_unref(L, LUA_REGISTRYINDEX, *(const int*)ptr); /* last use of the reference */
+		break;
 	case BT_STRUCTURE:
+	case BT_ROWS:
 		break;
 	}
 }
 
-static void PushValueByVARG(lua_State* L, tElement* pelem, tVaList* marker)
+/* Pushes nested tables for the dimension level of a shaped array and the inner ones,
+   reading the elements through the stride of each dimension. A reused table already
+   on the stack is filled again, with its sub-tables. Width must be zero. */
+static void PushShapedArray(lua_State* L, const uint8_t* pdata, tElement* pelem, 
+							int level, int freuse)
 {
-	lua_Number val;
-	luaL_checkstack(L, 1, NULL);
-	if(pelem->Width && (pelem->Type != BT_STRING && pelem->Type != BT_STRING_LIST))
+	const tDimension* dim = pelem->Dims + level;
+	size_t i;
+	luaL_checkstack(L, 2, NULL);
+	if(!freuse)
+		lua_createtable(L, (int)MIN(dim->Count, INT_MAX), 0);
+	for(i=0;i<dim->Count;i++,pdata+=dim->Stride)
 	{
-		int i;
-		const uint8_t* pdata = va_arg(marker->List, const uint8_t*);
-		int width = pelem->Width;
-		pelem->Width = 0;
-		lua_createtable(L, width, 0);
-		for(i=0;i<width;i++)
+		if(level + 1 < (int)pelem->NbDims)
 		{
-			PushValueByPointer(L, pdata, pelem);
-			lua_rawseti(L, -2, i+1);
-			pdata += pelem->Precision;
+			int fsubreuse = 0;
+			if(pelem->AllocateMode == MODE_FROM_STACK)
+			{
+				RawGetIndex(L, -1, i+1);
+				fsubreuse = lua_istable(L, -1);
+				if(!fsubreuse)
+					lua_pop(L, 1);
+			}
+			PushShapedArray(L, pdata, pelem, level + 1, fsubreuse);
 		}
-		pelem->Width = width;
-		return;
+		else
+			PushValueByPointer(L, pdata, pelem);
+		RawSetIndex(L, -2, i+1);
 	}
+	TrimReusedTable(L, pelem, dim->Count);
+}
+
+static lua_Number NumberByVARG(const tElement* pelem, tVaList* marker)
+{
 	switch(pelem->Type)
 	{
 	case BT_NUMBER:
 #if LGENCALL_USE_LONG_DOUBLE
 		if(pelem->Precision == sizeof(long double))
-			val = (lua_Number)va_arg(marker->List, long double);
-		else
+			return (lua_Number)VA_ARG(marker, long double);
 #endif
-			val = (lua_Number)va_arg(marker->List, double);
-		lua_pushnumber(L, val);
-		break;
+		return (lua_Number)VA_ARG(marker, double);
 	case BT_INTEGER:
 #if INT_MAX <= 2147483647 && LGENCALL_USE_64_BITS
 		if(pelem->Precision == 8)
-			val = (lua_Number)va_arg(marker->List, int64_t);
-		else
+			return (lua_Number)VA_ARG(marker, int64_t);
 #endif
-			val = (lua_Number)va_arg(marker->List, int);
-		lua_pushnumber(L, val);
-		break;
-	case BT_UNSIGNED:
+		return (lua_Number)VA_ARG(marker, int);
+	default:
 #if UINT_MAX <= 4294967295u && LGENCALL_USE_64_BITS > 1
 		if(pelem->Precision == 8)
-			val = (lua_Number)va_arg(marker->List, uint64_t);
-		else
+			return (lua_Number)VA_ARG(marker, uint64_t);
 #endif
-			val = (lua_Number)va_arg(marker->List, unsigned int);
-		lua_pushnumber(L, val);
-		break;
-	case BT_BOOLEAN:
-		lua_pushboolean(L, va_arg(marker->List, int));
-		break;
-	case BT_NIL:
-		lua_pushnil(L);
-		break;
-	case BT_STRING:
-	case BT_STRING_LIST:
-	case BT_LIGHT_POINTER:
-	case BT_FULL_POINTER:
-	case BT_THREAD:
-	case BT_FUNCTION:
-	case BT_CALLBACK:
-	case BT_STRUCTURE:
-	{
-		const void* value = va_arg(marker->List, const void*);
-		PushValueByPointer(L, &value, pelem);
-		break;
-	}
+		return (lua_Number)VA_ARG(marker, unsigned int);
 	}
 }
 
-static void LuaValueToPointer(const tEnvironment* penv, int idx, void* ptr, tElement* pelem)
+static void PushValueByVARG(lua_State* L, tElement* pelem, tVaList* marker)
 {
-	lua_Number val = 0;
-	lua_State* L = penv->L;
-	if(pelem->Width && (pelem->Type != BT_STRING && pelem->Type != BT_STRING_LIST))
+	luaL_checkstack(L, 1, NULL);
+	if(pelem->NbDims)
 	{
-		int i, len;
-		uint8_t* pdata = NULL;
-		int width = pelem->Width;
-		luaL_checktype(L, idx, LUA_TTABLE); 
-		len = (int)lua_objlen(L, idx);
-		switch(pelem->AllocateMode)
-		{
-		case MODE_USE_BUFFER:
-			pdata = (uint8_t*)ptr;
-			len = MIN(width, len);
-			break;
-		case MODE_FROM_STACK:
-			pdata = (uint8_t*)lua_newuserdata(L, len * pelem->Precision);
-			*(uint8_t**)ptr = pdata;
-			break;
-		case MODE_ALLOCATE:
-			pdata = (uint8_t*)MemoryAllocate(penv, len * pelem->Precision);
-			*(uint8_t**)ptr = pdata;
-			break;
+		const uint8_t* pdata = VA_ARG(marker, const uint8_t*);
+		size_t width = pelem->Width;
+		pelem->Width = 0;
+		PushShapedArray(L, pdata, pelem, 0, pelem->AllocateMode == MODE_FROM_STACK);
+		pelem->Width = width;
+		return;
+	}
+	if(IsArrayElement(pelem))
+	{
+		size_t i;
+		const uint8_t* pdata = VA_ARG(marker, const uint8_t*);
+		size_t width = pelem->Width;
+		pelem->Width = 0;
+		if(pelem->AllocateMode != MODE_FROM_STACK)
+			lua_createtable(L, (int)MIN(width, INT_MAX), 0);
+		i = 0;
+		if(pelem->Type == BT_NUMBER && pelem->Precision == sizeof(float))
+		{
+			for(;i<width;i++)
+			{
+				lua_pushnumber(L, ((const float*)pdata)[i]);
+				RawSetIndex(L, -2, i+1);
+			}
 		}
-		if(pelem->WidthMode == WIDTH_TO_OUTPUT)
+		else if(pelem->Type == BT_NUMBER && pelem->Precision == sizeof(double))
 		{
-			*(unsigned*)pelem->Pointer2 = len;
-			pelem->Width = len;
+			for(;i<width;i++)
+			{
+				lua_pushnumber(L, ((const double*)pdata)[i]);
+				RawSetIndex(L, -2, i+1);
+			}
 		}
-		pelem->Width = 0;
-		for(i=0;i<len;i++)
+		for(;i<width;i++)
 		{
-			lua_rawgeti(L, idx, i+1);
-			LuaValueToPointer(penv, -1, pdata, pelem);
-			lua_pop(L, 1);
-			pdata += pelem->Precision;
+			PushValueByPointer(L, pdata + i*pelem->Precision, pelem);
+			RawSetIndex(L, -2, i+1);
 		}
+		TrimReusedTable(L, pelem, width);
 		pelem->Width = width;
 		return;
 	}
@@ -719,14 +1121,116 @@ static void LuaValueToPointer(const tEnvironment* penv, int idx, void* ptr, tEle
 	case BT_NUMBER:
 	case BT_INTEGER:
 	case BT_UNSIGNED:
-		val = luaL_checknumber(L, idx);
+		lua_pushnumber(L, NumberByVARG(pelem, marker));
 		break;
 	case BT_BOOLEAN:
-		luaL_checktype(L, idx, LUA_TBOOLEAN); 
-		val = (lua_Number)lua_toboolean(L, idx);
-	default:
+		lua_pushboolean(L, VA_ARG(marker, int));
+		break;
+	case BT_NIL:
+		lua_pushnil(L);
+		break;
+	case BT_REFERENCE:
+	{
+		int ref = VA_ARG(marker, int);
+		PushValueByPointer(L, &ref, pelem);
+		break;
+	}
+	case BT_STRING:
+	case BT_STRING_LIST:
+	case BT_LIGHT_POINTER:
+	case BT_FULL_POINTER:
+	case BT_THREAD:
+	case BT_FUNCTION:
+	case BT_CALLBACK:
+	case BT_STRUCTURE:
+	case BT_ROWS:
+	{
+		const void* value = VA_ARG(marker, const void*);
+		PushValueByPointer(L, &value, pelem);
+		break;
+	}
+	}
+}
+
+static void OutputTypeError(lua_State* L, int idx, const tElement* pelem, int type)
+{
+	luaL_error(L, "output argument #%d: %s expected, got %s", (int)pelem->ArgumentNb, 
+		lua_typename(L, type), luaL_typename(L, idx));
+}
+
+/* Type checks of output values are skipped with the '!' flag, except for tables
+   and strings, which cannot be converted without them */
+static void CheckOutputType(lua_State* L, int idx, const tElement* pelem, int type)
+{
+	if(!pelem->fTrusted && lua_type(L, idx) != type)
+		OutputTypeError(L, idx, pelem, type);
+}
+
+static lua_Number OutputNumber(lua_State* L, int idx, const tElement* pelem)
+{
+	lua_Number val = lua_tonumber(L, idx);
+	if(val == 0 && !pelem->fTrusted && !lua_isnumber(L, idx))
+		OutputTypeError(L, idx, pelem, LUA_TNUMBER);
+	return val;
+}
+
+/* Copies the strings of a Lua array into a zero separated list of characters,
+   without building an intermediate concatenated string */
+static void StringListToPointer(const tEnvironment* penv, int idx, void* ptr, const tElement* pelem)
+{
+	lua_State* L = penv->L;
+	size_t i, n, len, pos, size, total = 0;
+	char* pdst = NULL;
+	const char* value;
+	if(idx < 0)
+		idx += lua_gettop(L) + 1;
+	if(!lua_istable(L, idx))
+		OutputTypeError(L, idx, pelem, LUA_TTABLE);
+	n = lua_objlen(L, idx);
+	for(i=1;i<=n;i++)
+	{
+		RawGetIndex(L, idx, i);
+		if(lua_tolstring(L, -1, &len) == NULL)
+			luaL_error(L, "invalid value (at index %d) in string list", (int)i);
+		total += len + 1;
+		lua_pop(L, 1);
+	}
+	if(pelem->WidthMode == WIDTH_TO_OUTPUT)
+		*(LGENCALL_WIDTH_TYPE*)pelem->Pointer2 = (LGENCALL_WIDTH_TYPE)total;
+	size = total + 1;
+	switch(pelem->AllocateMode)
+	{
+	case MODE_USE_BUFFER:
+		pdst = (char*)ptr;
+		size = MIN(size, pelem->Width);
+		break;
+	case MODE_FROM_STACK:
+		pdst = (char*)lua_newuserdata(L, size);
+		*(char**)ptr = pdst;
 		break;
+	case MODE_ALLOCATE:
+		pdst = (char*)MemoryAllocate(penv, size);
+		*(char**)ptr = pdst;
+		break;
+	}
+	for(i=1,pos=0;i<=n && pos<size;i++)
+	{
+		RawGetIndex(L, idx, i);
+		value = lua_tolstring(L, -1, &len);
+		len = MIN(len + 1, size - pos);
+		memcpy(pdst + pos, value, len);
+		pos += len;
+		lua_pop(L, 1);
 	}
+	if(pos < size)
+		pdst[pos] = 0;
+	if(pelem->AllocateMode == MODE_FROM_STACK)
+		lua_replace(L, idx);
+}
+
+/* Stores a number into a C variable of the type and precision of the element */
+static void StoreNumber(lua_State* L, void* ptr, const tElement* pelem, lua_Number val)
+{
 	switch(pelem->Type)
 	{
 	case BT_NUMBER:
@@ -739,7 +1243,7 @@ static void LuaValueToPointer(const tEnvironment* penv, int idx, void* ptr, tEle
 			*(long double*)ptr = (long double)val;
 #endif
 		else
-			luaL_error(L, "unknown floating precision %d", pelem->Precision);
+			luaL_error(L, "unknown floating precision %d", (int)pelem->Precision);
 		break;
 	case BT_UNSIGNED:
 		switch(pelem->Precision)
@@ -764,41 +1268,200 @@ static void LuaValueToPointer(const tEnvironment* penv, int idx, void* ptr, tEle
 #endif
 		}
 		break;
+	default:
+		break;
+	}
+}
+
+static void LuaValueToPointer(const tEnvironment* penv, int idx, void* ptr, tElement* pelem);
+
+/* Fills the caller buffer of a shaped array from nested tables, through the stride
+   of each dimension. A flat table is also accepted, with elements in row-major order.
+   Values beyond the dimensions are ignored. Items are converted through pitem, a copy
+   of the element without shape. */
+static void ShapedArrayToPointer(const tEnvironment* penv, int idx, uint8_t* pdata, 
+								 const tElement* pelem, tElement* pitem, int level)
+{
+	lua_State* L = penv->L;
+	const tDimension* dim = pelem->Dims + level;
+	size_t i, len;
+	int d, fflat;
+	if(idx < 0)
+		idx += lua_gettop(L) + 1;
+	if(!lua_istable(L, idx))
+		OutputTypeError(L, idx, pelem, LUA_TTABLE);
+	luaL_checkstack(L, 1, NULL);
+	len = lua_objlen(L, idx);
+	lua_rawgeti(L, idx, 1);
+	fflat = level == 0 && pelem->NbDims > 1 && !lua_istable(L, -1);
+	lua_pop(L, 1);
+	if(fflat)
+	{
+		size_t total = 1;
+		for(d=0;d<(int)pelem->NbDims;d++)
+			total *= pelem->Dims[d].Count;
+		len = MIN(len, total);
+		for(i=0;i<len;i++)
+		{
+			size_t rem = i, offset = 0;
+			for(d=pelem->NbDims-1;d>=0;d--)
+			{
+				offset += rem % pelem->Dims[d].Count * pelem->Dims[d].Stride;
+				rem /= pelem->Dims[d].Count;
+			}
+			RawGetIndex(L, idx, i+1);
+			LuaValueToPointer(penv, -1, pdata + offset, pitem);
+			lua_pop(L, 1);
+		}
+		return;
+	}
+	len = MIN(len, dim->Count);
+	for(i=0;i<len;i++,pdata+=dim->Stride)
+	{
+		RawGetIndex(L, idx, i+1);
+		if(level + 1 < (int)pelem->NbDims)
+			ShapedArrayToPointer(penv, -1, pdata, pelem, pitem, level + 1);
+		else
+			LuaValueToPointer(penv, -1, pdata, pitem);
+		lua_pop(L, 1);
+	}
+}
+
+static void LuaValueToPointer(const tEnvironment* penv, int idx, void* ptr, tElement* pelem)
+{
+	lua_Number val = 0;
+	lua_State* L = penv->L;
+	if(pelem->NbDims)
+	{
+		tElement item = *pelem;
+		item.NbDims = 0;
+		item.Width = 0;
+		ShapedArrayToPointer(penv, idx, (uint8_t*)ptr, pelem, &item, 0);
+		return;
+	}
+	if(IsArrayElement(pelem))
+	{
+		size_t i, len;
+		uint8_t* pdata = NULL;
+		size_t width = pelem->Width;
+		if(!lua_istable(L, idx))
+			OutputTypeError(L, idx, pelem, LUA_TTABLE);
+		len = lua_objlen(L, idx);
+		switch(pelem->AllocateMode)
+		{
+		case MODE_USE_BUFFER:
+			pdata = (uint8_t*)ptr;
+			len = MIN(width, len);
+			break;
+		case MODE_FROM_STACK:
+			pdata = (uint8_t*)lua_newuserdata(L, len * pelem->Precision);
+			*(uint8_t**)ptr = pdata;
+			break;
+		case MODE_ALLOCATE:
+			pdata = (uint8_t*)MemoryAllocate(penv, len * pelem->Precision);
+			*(uint8_t**)ptr = pdata;
+			break;
+		}
+		if(pelem->WidthMode == WIDTH_TO_OUTPUT)
+		{
+			*(LGENCALL_WIDTH_TYPE*)pelem->Pointer2 = (LGENCALL_WIDTH_TYPE)len;
+			pelem->Width = len;
+		}
+		pelem->Width = 0;
+		i = 0;
+		if(pelem->Type == BT_NUMBER || pelem->Type == BT_INTEGER || pelem->Type == BT_UNSIGNED)
+		{
+#if LGENCALL_USE_LUA_INTERNALS
+			/* Numbers stored in the array part of the table are read directly */
+			const Table* t = (const Table*)lua_topointer(L, idx);
+			size_t n = MIN(len, (size_t)t->sizearray);
+			for(;i<n && ttisnumber(&t->array[i]);i++,pdata+=pelem->Precision)
+				StoreNumber(L, pdata, pelem, nvalue(&t->array[i]));
+#endif
+			for(;i<len;i++,pdata+=pelem->Precision)
+			{
+				RawGetIndex(L, idx, i+1);
+				StoreNumber(L, pdata, pelem, OutputNumber(L, -1, pelem));
+				lua_pop(L, 1);
+			}
+		}
+		for(;i<len;i++,pdata+=pelem->Precision)
+		{
+			RawGetIndex(L, idx, i+1);
+			LuaValueToPointer(penv, -1, pdata, pelem);
+			lua_pop(L, 1);
+		}
+		pelem->Width = width;
+		return;
+	}
+	switch(pelem->Type)
+	{
+	case BT_NUMBER:
+	case BT_INTEGER:
+	case BT_UNSIGNED:
+		val = OutputNumber(L, idx, pelem);
+		break;
+	case BT_BOOLEAN:
+		CheckOutputType(L, idx, pelem, LUA_TBOOLEAN);
+		val = (lua_Number)lua_toboolean(L, idx);
+		break;
+	default:
+		break;
+	}
+	switch(pelem->Type)
+	{
+	case BT_NUMBER:
+	case BT_UNSIGNED:
+	case BT_INTEGER:
+	case BT_BOOLEAN:
+		StoreNumber(L, ptr, pelem, val);
+		break;
 	case BT_NIL:
 		break;
 	case BT_STRING_LIST:
 	{
 		size_t i, len;
 		luaL_Buffer b;
-		luaL_checktype(L, idx, LUA_TTABLE);
+		if(pelem->Precision == sizeof(char))
+		{
+			StringListToPointer(penv, idx, ptr, pelem);
+			break;
+		}
+		/* Wide lists are concatenated, then transcoded as a single string */
+		if(!lua_istable(L, idx))
+			OutputTypeError(L, idx, pelem, LUA_TTABLE);
 		luaL_buffinit(L, &b);
 		len = lua_objlen(L, idx);
 		for(i=1;i<=len;i++)
 		{
-			lua_rawgeti(L, idx, (int)i);
+			RawGetIndex(L, idx, i);
 			luaL_addvalue(&b);
 			luaL_addchar(&b, 0);
 		}
 		luaL_pushresult(&b);
 		lua_replace(L, idx);
-		/* Deliberate fall back into BT_STRING */
 	}
+	/* fallthrough - the concatenated list is transcoded as a single string */
 	case BT_STRING:
 	{
 		size_t len;
-		const char* value;
+		const char* value = lua_tolstring(L, idx, &len);
+		if(value == NULL)
+			OutputTypeError(L, idx, pelem, LUA_TSTRING);
 #if LGENCALL_USE_WIDESTRING
 		if(pelem->Precision == sizeof(wchar_t))
+		{
 			LuaStringToWideString(L, idx);
+			value = lua_tolstring(L, idx, &len);
+		}
 #endif
-		value = luaL_checklstring(L, idx, &len);
 		if(pelem->WidthMode == WIDTH_TO_OUTPUT)
-			*(unsigned*)pelem->Pointer2 = (unsigned)len / pelem->Precision;
+			*(LGENCALL_WIDTH_TYPE*)pelem->Pointer2 = (LGENCALL_WIDTH_TYPE)(len / pelem->Precision);
 		len++;
 		switch(pelem->AllocateMode)
 		{
 		case MODE_USE_BUFFER:
-			memcpy((char*)ptr, value, MIN(len, (size_t)(pelem->Width*pelem->Precision)));
+			memcpy((char*)ptr, value, MIN(len, pelem->Width*pelem->Precision));
 			break;
 		case MODE_FROM_STACK:
 			*(const char**)ptr = value;
@@ -811,187 +1474,2897 @@ static void LuaValueToPointer(const tEnvironment* penv, int idx, void* ptr, tEle
 		break;
 	}
 	case BT_LIGHT_POINTER:
-		luaL_checktype(L, idx, LUA_TLIGHTUSERDATA); 
+		if(!pelem->fTrusted && !lua_isuserdata(L, idx))	/* the address of a full userdatum is accepted as well */
+			OutputTypeError(L, idx, pelem, LUA_TLIGHTUSERDATA);
 		*(const void**)ptr = lua_topointer(L, idx);
 		break;
 	case BT_FULL_POINTER:
-		luaL_checktype(L, idx, LUA_TUSERDATA); 
+		CheckOutputType(L, idx, pelem, LUA_TUSERDATA);
 		*(const void**)ptr = lua_topointer(L, idx);
 		break;
 	case BT_THREAD:
-		luaL_checktype(L, idx, LUA_TTHREAD); 
+		CheckOutputType(L, idx, pelem, LUA_TTHREAD);
 		*(lua_State**)ptr = lua_tothread(L, idx);
 		break;
 	case BT_FUNCTION:
-		luaL_checktype(L, idx, LUA_TFUNCTION); 
+		CheckOutputType(L, idx, pelem, LUA_TFUNCTION);
 		*(lua_CFunction*)ptr = lua_tocfunction(L, idx);
 		break;
 	case BT_CALLBACK:
 		(*(lgencall_getCB)pelem->Pointer2)(L, idx, ptr);
 		break;
+	case BT_REFERENCE:
+		lua_pushvalue(L, idx);
+		*(int*)ptr = luaL_ref(L, LUA_REGISTRYINDEX);
+		break;
 	case BT_STRUCTURE:
+	case BT_ROWS:
 		break;
 	}
 }
 
 
+/* Size of the C type given by the type character and its modifiers */
+static void DefaultPrecision(tElement* element)
+{
+	size_t i;
+	for(i=0;i<sizeof(TypeSizes)/sizeof(TypeSizes[0]);i++)
+	{
+		if(TypeSizes[i].TypeStart > element->Type || 
+		   TypeSizes[i].TypeEnd < element->Type)
+			continue;
+		if(TypeSizes[i].Modifier == 0)
+			element->Precision = TypeSizes[i].Bytes;
+		if(TypeSizes[i].Modifier == element->TypeModifier)
+		{
+			element->Precision = TypeSizes[i].Bytes;
+			return;
+		}
+	}
+}
+
 static void CheckAndRetrieveWidth(lua_State* L, tElement* element, tVaList* marker)
 {
 	size_t i;
+	for(i=0;i<element->NbDims;i++)
+	{
+		tDimension* dim = element->Dims + i;
+		if(dim->Count == DIM_FROM_ARGUMENT)
+			dim->Count = (size_t)VA_ARG(marker, LGENCALL_WIDTH_TYPE);
+		if(dim->Stride == DIM_FROM_ARGUMENT)
+			dim->Stride = (size_t)VA_ARG(marker, LGENCALL_WIDTH_TYPE);
+	}
 	if(element->WidthMode == WIDTH_FROM_ARGUMENT)
-		element->Width = va_arg(marker->List, unsigned int);
+		element->Width = (size_t)VA_ARG(marker, LGENCALL_WIDTH_TYPE);
+	if(element->fTrusted && element->Direction == DIR_INPUT)
+		luaL_error(L, "argument #%d: '!' character only allowed for output parameter", element->ArgumentNb);
 	if(element->WidthMode == WIDTH_TO_OUTPUT)
 	{
 		if(element->Direction == DIR_INPUT)
 			luaL_error(L, "argument #%d: '&' character only allowed for output parameter", element->ArgumentNb);
-		element->Pointer2 = va_arg(marker->List, void*);
+		element->Pointer2 = VA_ARG(marker, void*);
 		if(element->AllocateMode == MODE_USE_BUFFER)
-			element->Width = *(int*)element->Pointer2;
+			element->Width = (size_t)*(LGENCALL_WIDTH_TYPE*)element->Pointer2;
 		else
 			element->Width = 1;
 	}
-	if(element->AllocateMode != MODE_USE_BUFFER && element->Width == 0)
+	if(element->AllocateMode != MODE_USE_BUFFER && element->Width == 0
+		&& !(element->Type == BT_REFERENCE && element->Direction == DIR_INPUT))	/* %#o input only releases the reference */
 		element->Width = 1;
 	if(element->Type == BT_CALLBACK)
-		element->Pointer2 = va_arg(marker->List, void*);
+		element->Pointer2 = VA_ARG(marker, void*);
 	if(element->PrecisionMode == WIDTH_FROM_ARGUMENT)
-		element->Precision = va_arg(marker->List, unsigned int);
+		element->Precision = VA_ARG(marker, unsigned int);
 	if(element->Precision == 0)
+		DefaultPrecision(element);
+}
+
+/* Validates a multi-dimensional or strided array, and computes its default strides:
+   contiguous elements in the last dimension, packed sub-arrays in the others */
+static void CheckArrayShape(lua_State* L, tElement* element)
+{
+	int i;
+	size_t stride = element->Precision;
+	if(element->Type == BT_STRING || element->Type == BT_STRING_LIST || 
+	   element->Type == BT_NIL || element->Type == BT_ROWS)
+		luaL_error(L, "argument #%d: array shape not allowed for this type", element->ArgumentNb);
+	if(element->Direction == DIR_OUTPUT && element->AllocateMode != MODE_USE_BUFFER)
+		luaL_error(L, "argument #%d: output array with a shape must use a caller buffer", element->ArgumentNb);
+	for(i=element->NbDims-1;i>=0;i--)
+	{
+		tDimension* dim = element->Dims + i;
+		if(dim->Stride == 0)
+			dim->Stride = stride;
+		stride = dim->Count * dim->Stride;
+	}
+	element->Width = element->Dims[0].Count;
+}
+
+typedef struct tRowIterator
+{
+	lgencall_rowsCB Fct;  /* NULL at the end of the rows, or after the call */
+	void* Ud;
+	struct tRowIterator* Next;  /* iterators of the same call */
+	uint8_t* Rows;
+	size_t RowSize;
+	size_t ChunkSize;
+	size_t NbRows;
+	size_t Current;
+	int NbFields;
+	tElement* Fields;
+	size_t* Offsets;
+} tRowIterator;
+
+/* Size of a row field in the C structure, also used as its alignment */
+static size_t RowFieldSize(const tElement* field)
+{
+	switch(field->Type)
+	{
+	case BT_NIL:
+		return 0;
+	case BT_STRING:
+	case BT_STRING_LIST:
+	case BT_LIGHT_POINTER:
+	case BT_FULL_POINTER:
+		return sizeof(void*);
+	case BT_THREAD:
+		return sizeof(lua_State*);
+	case BT_FUNCTION:
+		return sizeof(lua_CFunction);
+	default:
+		return field->Precision;
+	}
+}
+
+static int NextRow(lua_State* L)
+{
+	int i;
+	uint8_t* row;
+	tRowIterator* it = (tRowIterator*)lua_touserdata(L, lua_upvalueindex(1));
+	if(it->Current == it->NbRows)
 	{
-		for(i=0;i<sizeof(TypeSizes)/sizeof(TypeSizes[0]);i++)
+		if(it->Fct == NULL)
+			return 0;
+		it->NbRows = (*it->Fct)(it->Ud, it->Rows, it->ChunkSize);
+		it->NbRows = MIN(it->NbRows, it->ChunkSize);
+		it->Current = 0;
+		if(it->NbRows == 0)
 		{
-			if(TypeSizes[i].TypeStart > element->Type || 
-			   TypeSizes[i].TypeEnd < element->Type)
-				continue;
-			if(TypeSizes[i].Modifier == 0)
-				element->Precision = TypeSizes[i].Bytes;
-			if(TypeSizes[i].Modifier == element->TypeModifier)
-			{
-				element->Precision = TypeSizes[i].Bytes;
-				return;
-			}
+			it->Fct = NULL;
+			return 0;
 		}
 	}
+	row = it->Rows + it->Current++ * it->RowSize;
+	luaL_checkstack(L, it->NbFields, NULL);
+	for(i=0;i<it->NbFields;i++)
+		PushValueByPointer(L, row + it->Offsets[i], it->Fields + i);
+	return it->NbFields;
 }
 
-
-void EnvironmentParameter(tEnvironment* penv, tElement* element, tVaList* marker)
+/* Pushes an iterator function, which returns the fields of one row per call.
+   Rows are fetched by chunks from the user callback, into a buffer owned by the iterator.
+   The iterator is also kept below the function, so that EndRowIterators can reach it. */
+static void PushRowIterator(tEnvironment* penv, tElement* pelem, tVaList* marker)
 {
 	lua_State* L = penv->L;
-	switch(element->EnvType)
+	const char* format = VA_ARG(marker, const char*);
+	tRowIterator* it;
+	size_t offset = 0, align = 1, size;
+	int i, nbfields = 0;
+	for(i=0;format[i];i++)
+		if(format[i] == '%')
+			nbfields++;
+	if(nbfields == 0)
+		luaL_error(L, "argument #%d: empty row format", pelem->ArgumentNb);
+	it = (tRowIterator*)lua_newuserdata(L, sizeof(tRowIterator) + nbfields*(sizeof(tElement)+sizeof(size_t)));
+	memset(it, 0, sizeof(tRowIterator) + nbfields*sizeof(tElement));
+	it->Fields = (tElement*)(it + 1);
+	it->Offsets = (size_t*)(it->Fields + nbfields);
+	it->NbFields = nbfields;
+	for(i=0;i<nbfields;i++)
 	{
-	case DT_BASIC_TYPE:
-		luaL_error(L, "Only capital letters for global options");
-		break;
-	case DT_MEMORY_ALLOC:
-		if(element->WidthMode == WIDTH_TO_OUTPUT)
+		tElement* field = it->Fields + i;
+		format = GetNextElement(penv, format, field);
+		if(field->EnvType != DT_BASIC_TYPE || field->AllocateMode != MODE_USE_BUFFER ||
+		   field->WidthMode != WIDTH_FROM_FORMAT || field->PrecisionMode != WIDTH_FROM_FORMAT ||
+		   field->Width || field->Type == BT_CALLBACK || field->Type == BT_ROWS)
+			luaL_error(L, "argument #%d: row field %d must be a scalar or a string", pelem->ArgumentNb, i+1);
+		CheckAndRetrieveWidth(L, field, NULL);
+		size = RowFieldSize(field);
+		if(size == 0)
 		{
-			*va_arg(marker->List, lua_Alloc*) = penv->AllocFct;
-			if(element->AllocateMode == MODE_FROM_STACK)
-				*va_arg(marker->List, void**) = penv->AllocUd;
+			it->Offsets[i] = offset;
+			continue;
 		}
-		else
+		if((size & (size - 1)) == 0)
 		{
-			penv->AllocFct = va_arg(marker->List, lua_Alloc);
-			if(element->AllocateMode == MODE_FROM_STACK)
-				penv->AllocUd = va_arg(marker->List, void*);
-			if(penv->fOpenState && !penv->fRestarted)
-				penv->fNeedRestart = 1;
+			offset = (offset + size - 1) & ~(size - 1);
+			align = MAX(align, size);
 		}
-		break;
-	case DT_CLOSE_STATE:
-		penv->fCloseState = 1;
-		break;
-	case DT_OPEN_LIBRARY:
-		luaL_openlibs(L);
-		break;
-	case DT_GET_STATE:
-		*va_arg(marker->List, lua_State**) = L;
-		penv->fCloseState = 0;
-		break;
-	case DT_CLEAR_CACHE:
-		lua_pushnil(L);
-		lua_setfield(L, LUA_REGISTRYINDEX, COMPILED_TABLE);
-		break;
-	case DT_COLLECT_GARBAGE:
-		lua_gc(L, LUA_GCCOLLECT, 0);
-		break;
+		it->Offsets[i] = offset;
+		offset += size;
 	}
+	it->RowSize = (offset + align - 1) / align * align;
+	it->ChunkSize = pelem->Width ? pelem->Width : ROWS_CHUNK_SIZE;
+	it->Fct = VA_ARG(marker, lgencall_rowsCB);
+	it->Ud = VA_ARG(marker, void*);
+	it->Rows = (uint8_t*)lua_newuserdata(L, it->ChunkSize * it->RowSize);
+	it->Next = penv->RowIterators;
+	penv->RowIterators = it;
+	luaL_checkstack(L, 1, NULL);
+	lua_pushvalue(L, -2);
+	lua_insert(L, penv->IdxFunction++);
+	lua_pushcclosure(L, NextRow, 2);
 }
 
-/* Function copied from lua.c */
-static int traceback (lua_State *L) {
-  lua_getfield(L, LUA_GLOBALSINDEX, "debug");
-  if (!lua_istable(L, -1)) {
-    lua_pop(L, 1);
-    return 1;
-  }
-  lua_getfield(L, -1, "traceback");
-  if (!lua_isfunction(L, -1)) {
-    lua_pop(L, 2);
-    return 1;
-  }
-  lua_pushvalue(L, 1);  /* pass error message */
-  lua_pushinteger(L, 2);  /* skip this function and traceback */
-  lua_call(L, 2, 1);  /* call debug.traceback */
-  return 1;
+/* The callbacks are only valid during the call: an iterator kept by the script ends there */
+static void EndRowIterators(tEnvironment* penv)
+{
+	tRowIterator* it;
+	for(it=penv->RowIterators;it;it=it->Next)
+		it->Fct = NULL;
+	penv->RowIterators = NULL;
 }
 
-
-static void genericcallA(tEnvironment* penv, const char* script, const char* format, tVaList* marker)
+/* FNV-1a hash */
+static uint32_t HashBytes(const void* data, size_t len)
+{
+	const uint8_t* pdata = (const uint8_t*)data;
+	uint32_t hash = 2166136261u;
+	while(len--)
+		hash = (hash ^ *pdata++) * 16777619u;
+	return hash;
+}
+
+#if LGENCALL_USE_BYTECODE_STORE
+
+/* Process wide store of compiled chunks, indexed by their script */
+#define STORE_BUCKETS 256
+
+#ifdef _WIN32
+static SRWLOCK StoreLock = SRWLOCK_INIT;
+#define STORE_LOCK()   AcquireSRWLockExclusive(&StoreLock)
+#define STORE_UNLOCK() ReleaseSRWLockExclusive(&StoreLock)
+#else
+static pthread_mutex_t StoreLock = PTHREAD_MUTEX_INITIALIZER;
+#define STORE_LOCK()   pthread_mutex_lock(&StoreLock)
+#define STORE_UNLOCK() pthread_mutex_unlock(&StoreLock)
+#endif
+
+typedef struct tStoredChunk
+{
+	struct tStoredChunk* Next;
+	uint32_t Hash;
+	int NbUsers;    /* states loading the chunk, which is only freed when it drops to 0 */
+	int fRemoved;
+	size_t Size;    /* size of the bytecode, which follows the script */
+	char Script[1];
+} tStoredChunk;
+
+typedef struct
+{
+	char* Data;
+	size_t Size;
+	size_t Capacity;
+} tDumpBuffer;
+
+static tStoredChunk* BytecodeStore[STORE_BUCKETS];
+static lgencall_storestats StoreStats;
+
+static int DumpWriter(lua_State* L, const void* p, size_t size, void* ud)
+{
+	tDumpBuffer* b = (tDumpBuffer*)ud;
+	(void)L;
+	if(b->Size + size > b->Capacity)
+	{
+		size_t capacity = MAX(2*b->Capacity, b->Size + size);
+		char* data = (char*)realloc(b->Data, capacity);
+		if(data == NULL)
+			return 1;
+		b->Data = data;
+		b->Capacity = capacity;
+	}
+	memcpy(b->Data + b->Size, p, size);
+	b->Size += size;
+	return 0;
+}
+
+/* Must be called with the store locked */
+static const tStoredChunk* FindInStore(uint32_t hash, const char* script)
+{
+	const tStoredChunk* chunk;
+	for(chunk=BytecodeStore[hash % STORE_BUCKETS];chunk;chunk=chunk->Next)
+		if(chunk->Hash == hash && strcmp(chunk->Script, script) == 0)
+			return chunk;
+	return NULL;
+}
+
+/* Pushes the chunk loaded from the store, and returns 0 if the script is not there.
+   The lock is not held while loading, since the garbage collector may run scripts. */
+static int LoadFromStore(lua_State* L, const char* script)
+{
+	tStoredChunk* chunk;
+	int res;
+	STORE_LOCK();
+	chunk = (tStoredChunk*)FindInStore(HashBytes(script, strlen(script)), script);
+	if(chunk)
+	{
+		chunk->NbUsers++;
+		StoreStats.hits++;
+	}
+	else
+		StoreStats.misses++;
+	STORE_UNLOCK();
+	if(chunk == NULL)
+		return 0;
+	res = luaL_loadbuffer(L, chunk->Script + strlen(script) + 1, chunk->Size, script);
+	STORE_LOCK();
+	if(--chunk->NbUsers || !chunk->fRemoved)
+		chunk = NULL;
+	STORE_UNLOCK();
+	free(chunk);
+	if(res)
+		lua_error(L);
+	return 1;
+}
+
+/* Saves the bytecode of the chunk on top of the stack. Failures are ignored,
+   the chunk being then compiled again by the other states. */
+static void SaveToStore(lua_State* L, const char* script)
+{
+	size_t len = strlen(script);
+	uint32_t hash = HashBytes(script, len);
+	tStoredChunk *chunk, **pbucket = BytecodeStore + hash % STORE_BUCKETS;
+	tDumpBuffer b;
+	memset(&b, 0, sizeof(b));
+	if(lua_dump(L, DumpWriter, &b) == 0 && b.Size)
+	{
+		chunk = (tStoredChunk*)malloc(sizeof(tStoredChunk) + len + b.Size);
+		if(chunk)
+		{
+			chunk->Hash = hash;
+			chunk->NbUsers = 0;
+			chunk->fRemoved = 0;
+			chunk->Size = b.Size;
+			memcpy(chunk->Script, script, len + 1);
+			memcpy(chunk->Script + len + 1, b.Data, b.Size);
+			STORE_LOCK();
+			/* Another state may have stored the same script meanwhile */
+			if(FindInStore(hash, script) == NULL)
+			{
+				chunk->Next = *pbucket;
+				*pbucket = chunk;
+				chunk = NULL;
+				StoreStats.chunks++;
+				StoreStats.bytes += b.Size;
+			}
+			STORE_UNLOCK();
+			free(chunk);
+		}
+	}
+	free(b.Data);
+}
+
+static void ClearStore(void)
 {
-	tElement* element;
 	int i;
-	eDirection direction = DIR_INPUT;
-	int nbparams[2] = {0,0};
+	STORE_LOCK();
+	for(i=0;i<STORE_BUCKETS;i++)
+	{
+		while(BytecodeStore[i])
+		{
+			tStoredChunk* chunk = BytecodeStore[i];
+			BytecodeStore[i] = chunk->Next;
+			if(chunk->NbUsers)
+				chunk->fRemoved = 1;
+			else
+				free(chunk);
+		}
+	}
+	StoreStats.chunks = 0;
+	StoreStats.bytes = 0;
+	STORE_UNLOCK();
+}
+
+#else
+#define LoadFromStore(L, script) 0
+#define SaveToStore(L, script)
+#endif
+
+/* Standard libraries, in the bit order of the LGENCALL_LIB_XXX masks */
+static const luaL_Reg StandardLibraries[] = 
+{
+	{ "", luaopen_base },
+	{ LUA_LOADLIBNAME, luaopen_package },
+	{ LUA_TABLIBNAME, luaopen_table },
+	{ LUA_IOLIBNAME, luaopen_io },
+	{ LUA_OSLIBNAME, luaopen_os },
+	{ LUA_STRLIBNAME, luaopen_string },
+	{ LUA_MATHLIBNAME, luaopen_math },
+	{ LUA_DBLIBNAME, luaopen_debug },
+	{ NULL, NULL }
+};
+
+static void OpenLibraries(lua_State* L, unsigned int mask)
+{
+	const luaL_Reg* lib;
+	unsigned int bit;
+	if((mask & LGENCALL_LIB_ALL) == LGENCALL_LIB_ALL)
+	{
+		luaL_openlibs(L);
+		return;
+	}
+	for(lib=StandardLibraries,bit=1;lib->func;lib++,bit<<=1)
+	{
+		if((mask & bit) == 0)
+			continue;
+		lua_pushcfunction(L, lib->func);
+		lua_pushstring(L, lib->name);
+		lua_call(L, 1, 0);
+	}
+	if((mask & LGENCALL_LIB_PACKAGE) == 0)
+		return;
+	/* The other libraries are only opened when required by a script */
+	lua_getfield(L, LUA_GLOBALSINDEX, LUA_LOADLIBNAME);
+	lua_getfield(L, -1, "preload");
+	for(lib=StandardLibraries+1,bit=2;lib->func;lib++,bit<<=1)
+	{
+		if(mask & bit)
+			continue;
+		lua_pushcfunction(L, lib->func);
+		lua_setfield(L, -2, lib->name);
+	}
+	lua_pop(L, 2);
+}
+
+static uint64_t GetMicroseconds(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (uint64_t)(counter.QuadPart / (frequency.QuadPart / 1000000.0));
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#else
+	return (uint64_t)(clock() / (CLOCKS_PER_SEC / 1000000.0));
+#endif
+}
+
+#if LGENCALL_USE_TRACE
+
+/* Phases of a generic call recorded by the tracer */
+typedef enum
+{
+	TP_SETUP,
+	TP_FORMAT,
+	TP_COMPILE,
+	TP_PUSH,
+	TP_CALL,
+	TP_OUTPUT,
+	TP_CLOSE
+} eTracePhase;
+
+static const char* const TracePhaseNames[] = 
+{
+	"setup", "format", "compile", "push", "call", "output", "close"
+};
+
+#define TRACE_SIZE 2048
+#define TRACE_MAX_DEPTH 64   /* open phases, of nested calls too */
+
+typedef struct
+{
+	uint64_t Time;   /* in TSC ticks when available, else in microseconds */
+	uint8_t Phase;
+	uint8_t fBegin;
+} tTraceEvent;
+
+typedef struct
+{
+	tTraceEvent Events[TRACE_SIZE];
+	uint32_t Next;
+	uint32_t Count;
+	uint32_t Depth;
+	uint8_t Open[TRACE_MAX_DEPTH];  /* phases begun and not ended yet */
+	uint64_t StartTicks;
+	uint64_t StartTime;
+	int fEnabled;
+} tTraceBuffer;
+
+#if defined(_MSC_VER)
+static __declspec(thread) tTraceBuffer Trace;
+#elif defined(__GNUC__)
+static __thread tTraceBuffer Trace;
+#else
+static _Thread_local tTraceBuffer Trace;
+#endif
+
+/* Only the running thread uses its buffer, so no lock is needed. An end event is
+   dropped if its phase began before the tracer was enabled or the trace was dumped. */
+static void TraceEvent(eTracePhase phase, int fbegin)
+{
+	tTraceEvent* event = Trace.Events + Trace.Next;
+	if(fbegin)
+	{
+		if(Trace.Depth == TRACE_MAX_DEPTH)
+			return;
+		Trace.Open[Trace.Depth++] = (uint8_t)phase;
+	}
+	else if(Trace.Depth && Trace.Open[Trace.Depth - 1] == phase)
+		Trace.Depth--;
+	else
+		return;
+	event->Time = READ_TSC();
+	event->Phase = (uint8_t)phase;
+	event->fBegin = (uint8_t)fbegin;
+	Trace.Next = (Trace.Next + 1) % TRACE_SIZE;
+	if(Trace.Count < TRACE_SIZE)
+		Trace.Count++;
+}
+
+static void EnableTrace(int fenable)
+{
+	if(fenable && !Trace.fEnabled)
+	{
+		Trace.StartTicks = READ_TSC();
+		Trace.StartTime = GetMicroseconds();
+		Trace.Next = Trace.Count = Trace.Depth = 0;
+	}
+	Trace.fEnabled = fenable;
+}
+
+/* Ends the phases left open by a call which failed or was restarted */
+static void CloseTrace(uint32_t depth)
+{
+	while(Trace.Depth > depth)
+	{
+		if(Trace.fEnabled)
+			TraceEvent((eTracePhase)Trace.Open[Trace.Depth - 1], 0);
+		else
+			Trace.Depth--;
+	}
+}
+
+/* Returns the events of the thread in Chrome trace-event JSON format, allocated with
+   the Lua allocation function, and clears them */
+static char* DumpTrace(const tEnvironment* penv)
+{
+	uint64_t ticks = READ_TSC() - Trace.StartTicks;
+	double scale = ticks ? (double)(GetMicroseconds() - Trace.StartTime) / ticks : 1.0;
+	unsigned long tid = (unsigned long)((size_t)&Trace & 0xFFFFFFFF);
+	uint32_t i, pos = (Trace.Next + TRACE_SIZE - Trace.Count) % TRACE_SIZE;
+	char* res = (char*)MemoryAllocate(penv, Trace.Count * 96 + 32);
+	char* pdst = res;
+	if(res == NULL)
+		luaL_error(penv->L, "not enough memory");
+	pdst += sprintf(pdst, "{\"traceEvents\":[");
+	for(i=0;i<Trace.Count;i++,pos=(pos+1)%TRACE_SIZE)
+	{
+		const tTraceEvent* event = Trace.Events + pos;
+		pdst += sprintf(pdst, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%lu}", 
+			i ? "," : "", TracePhaseNames[event->Phase], event->fBegin ? 'B' : 'E', 
+			(double)(event->Time - Trace.StartTicks) * scale, tid);
+	}
+	sprintf(pdst, "\n]}\n");
+	Trace.Next = Trace.Count = Trace.Depth = 0;
+	return res;
+}
+
+#define TRACE_BEGIN(phase) do { if(Trace.fEnabled) TraceEvent(phase, 1); } while(0)
+#define TRACE_END(phase)   do { if(Trace.fEnabled) TraceEvent(phase, 0); } while(0)
+#define TRACE_DEPTH()      Trace.Depth
+#define TRACE_CLOSE(depth) CloseTrace(depth)
+#else
+#define TRACE_BEGIN(phase)
+#define TRACE_END(phase)
+#define TRACE_DEPTH()      0
+#define TRACE_CLOSE(depth) ((void)(depth))
+#endif
+
+/* Samples recorded by the hook, which must not allocate: each one is a tSample followed
+   by its collapsed stack, padded to the size of tSample */
+typedef struct
+{
+	uint32_t Count;
+	uint32_t Length;
+} tSample;
+
+typedef struct tProfileBuffer
+{
+	size_t Used;      /* in bytes */
+	size_t Dropped;   /* samples which did not fit */
+	int NbCalls;      /* profiled calls running on the state */
+	tSample Data[PROFILE_BUFFER_SIZE / sizeof(tSample)];
+} tProfileBuffer;
+
+#define SAMPLE_SIZE(len) (sizeof(tSample) + ((len) + sizeof(tSample) - 1) / sizeof(tSample) * sizeof(tSample))
+
+/* Writes a frame name of a collapsed stack, without the separators of the format, and
+   followed by ';' if fnext. Returns its length, or (size_t)-1 if it does not fit. */
+static size_t AddProfileFrame(char* dst, size_t room, const lua_Debug* ar, int fnext)
+{
+	char frame[LUA_IDSIZE + 64];
+	size_t i, len;
+	if(*ar->what == 'm')
+		len = sprintf(frame, "%s", ar->short_src);
+	else if(*ar->what == 'C')
+		len = sprintf(frame, "%.60s", ar->name ? ar->name : "?");
+	else
+		len = sprintf(frame, "%.30s@%s:%d", ar->name ? ar->name : "?", ar->short_src, ar->linedefined);
+	if(len + (fnext != 0) > room)
+		return (size_t)-1;
+	for(i=0;i<len;i++)
+		dst[i] = frame[i] == ';' || frame[i] == '\n' ? ',' : frame[i];
+	if(fnext)
+		dst[len++] = ';';
+	return len;
+}
+
+/* Records a sample of the current Lua stack, from the chunk to the running function,
+   in the buffer of the state. A stack already sampled by the call is only counted. */
+static void SampleStack(const tEnvironment* penv)
+{
 	lua_State* L = penv->L;
-	int idxbase, idxtrace;
+	tProfileBuffer* buf = penv->ProfileBuffer;
+	char* base = (char*)buf->Data;
+	tSample* sample = (tSample*)(base + buf->Used);
+	char* text = (char*)(sample + 1);
+	size_t pos, len = 0, room = sizeof(buf->Data) - buf->Used;
+	lua_Debug ar;
+	int level, depth;
+	room = room < 2*sizeof(tSample) ? 0 : (room - sizeof(tSample)) / sizeof(tSample) * sizeof(tSample);
+	for(depth=0;depth<PROFILE_MAX_DEPTH && lua_getstack(L, depth, &ar);depth++);
+	for(level=depth-1;level>=0;level--)
+	{
+		size_t n;
+		lua_getstack(L, level, &ar);
+		lua_getinfo(L, "Sn", &ar);
+		n = AddProfileFrame(text + len, room - len, &ar, level != 0);
+		if(n == (size_t)-1)
+		{
+			buf->Dropped++;
+			return;
+		}
+		len += n;
+	}
+	for(pos=penv->ProfileStart;pos<buf->Used;pos+=SAMPLE_SIZE(((tSample*)(base + pos))->Length))
+	{
+		tSample* prev = (tSample*)(base + pos);
+		if(prev->Length == len && memcmp(prev + 1, text, len) == 0)
+		{
+			prev->Count++;
+			return;
+		}
+	}
+	sample->Count = 1;
+	sample->Length = (uint32_t)len;
+	buf->Used += SAMPLE_SIZE(len);
+}
+
+static void CountSamples(lua_State* L, const char* stack, size_t len, double count)
+{
+	lua_pushlstring(L, stack, len);
+	lua_pushvalue(L, -1);
+	lua_rawget(L, -3);
+	lua_pushnumber(L, lua_tonumber(L, -1) + count);
+	lua_replace(L, -2);
+	lua_rawset(L, -3);
+}
+
+/* Counts the samples of the call in the table of its script, after the call */
+static void FlushProfile(tEnvironment* penv)
+{
+	lua_State* L = penv->L;
+	tProfileBuffer* buf = penv->ProfileBuffer;
+	size_t pos;
+	if(buf == NULL)
+		return;
+	penv->ProfileBuffer = NULL;
+	if(buf->Used > penv->ProfileStart || buf->Dropped)
+	{
+		luaL_checkstack(L, 6, NULL);
+		lua_getfield(L, LUA_REGISTRYINDEX, PROFILE_TABLE);
+		if(!lua_istable(L, -1))
+		{
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushvalue(L, -1);
+			lua_setfield(L, LUA_REGISTRYINDEX, PROFILE_TABLE);
+		}
+		lua_getfield(L, -1, penv->Script);
+		if(!lua_istable(L, -1))
+		{
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushvalue(L, -1);
+			lua_setfield(L, -3, penv->Script);
+		}
+		for(pos=penv->ProfileStart;pos<buf->Used;)
+		{
+			const tSample* sample = (const tSample*)((char*)buf->Data + pos);
+			CountSamples(L, (const char*)(sample + 1), sample->Length, sample->Count);
+			pos += SAMPLE_SIZE(sample->Length);
+		}
+		if(buf->Dropped)
+			CountSamples(L, "[dropped]", 9, (double)buf->Dropped);
+		buf->Dropped = 0;
+		lua_pop(L, 2);
+	}
+	buf->Used = penv->ProfileStart;
+}
+
+/* Length of the samples of the table on top of the stack as collapsed stacks,
+   which are also written at pos when it is not NULL */
+static size_t CollapsedStacks(lua_State* L, char* pos)
+{
+	char count[32];
+	size_t len, total = 0;
+	lua_pushnil(L);
+	while(lua_next(L, -2))
+	{
+		const char* stack = lua_tolstring(L, -2, &len);
+		if(pos)
+			memcpy(pos + total, stack, len);
+		total += len;
+		total += sprintf(pos ? pos + total : count, " %.0f\n", lua_tonumber(L, -1));
+		lua_pop(L, 1);
+	}
+	return total;
+}
+
+/* Returns the samples of a script as collapsed stacks, one "frame;frame count" line per
+   stack, allocated with the Lua allocation function, and clears them. An empty script
+   returns the samples of all the scripts. */
+static char* ExportProfile(const tEnvironment* penv, const char* script)
+{
+	lua_State* L = penv->L;
+	char* res = NULL;
+	size_t len = 0;
+	int pass;
+	lua_getfield(L, LUA_REGISTRYINDEX, PROFILE_TABLE);
+	if(!lua_istable(L, -1))
+	{
+		lua_pop(L, 1);
+		return NULL;
+	}
+	for(pass=0;pass<2;pass++)
+	{
+		lua_pushnil(L);
+		while(lua_next(L, -2))
+		{
+			if(*script == 0 || strcmp(lua_tostring(L, -2), script) == 0)
+				len += CollapsedStacks(L, res ? res + len : NULL);
+			lua_pop(L, 1);
+		}
+		if(res)
+			break;
+		if(len == 0)
+		{
+			lua_pop(L, 1);
+			return NULL;
+		}
+		res = (char*)MemoryAllocate(penv, len + 1);
+		if(res == NULL)
+			luaL_error(L, "not enough memory");
+		len = 0;
+	}
+	res[len] = 0;
+	lua_pushnil(L);
+	if(*script)
+		lua_setfield(L, -2, script);
+	else
+		lua_setfield(L, LUA_REGISTRYINDEX, PROFILE_TABLE);
+	lua_pop(L, 1);
+	return res;
+}
+
+void EnvironmentParameter(tEnvironment* penv, tElement* element, tVaList* marker)
+{
+	lua_State* L = penv->L;
+	switch(element->EnvType)
+	{
+	case DT_BASIC_TYPE:
+		luaL_error(L, "Only capital letters for global options");
+		break;
+	case DT_MEMORY_ALLOC:
+		if(element->WidthMode == WIDTH_TO_OUTPUT)
+		{
+			*VA_ARG(marker, lua_Alloc*) = penv->AllocFct;
+			if(element->AllocateMode == MODE_FROM_STACK)
+				*VA_ARG(marker, void**) = penv->AllocUd;
+		}
+		else
+		{
+			penv->AllocFct = VA_ARG(marker, lua_Alloc);
+			if(element->AllocateMode == MODE_FROM_STACK)
+				penv->AllocUd = VA_ARG(marker, void*);
+			if(penv->fOpenState && !penv->fRestarted)
+				penv->fNeedRestart = 1;
+		}
+		break;
+	case DT_CLOSE_STATE:
+		penv->fCloseState = 1;
+		break;
+	case DT_OPEN_LIBRARY:
+		if(element->WidthMode == WIDTH_FROM_ARGUMENT)
+			OpenLibraries(L, VA_ARG(marker, unsigned int));
+		else
+			luaL_openlibs(L);
+		break;
+	case DT_GET_STATE:
+		*VA_ARG(marker, lua_State**) = L;
+		penv->fCloseState = 0;
+		break;
+	case DT_CLEAR_CACHE:
+		if(element->WidthMode == WIDTH_TO_OUTPUT)
+		{
+			lgencall_storestats* stats = VA_ARG(marker, lgencall_storestats*);
+#if LGENCALL_USE_BYTECODE_STORE
+			STORE_LOCK();
+			*stats = StoreStats;
+			STORE_UNLOCK();
+#else
+			memset(stats, 0, sizeof(lgencall_storestats));
+#endif
+			break;
+		}
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, COMPILED_TABLE);
+#if LGENCALL_USE_BYTECODE_STORE
+		if(element->AllocateMode == MODE_ALLOCATE)
+			ClearStore();
+#endif
+		break;
+	case DT_COLLECT_GARBAGE:
+		if(element->WidthMode == WIDTH_TO_OUTPUT)
+			penv->GcStats = VA_ARG(marker, lgencall_gcstats*);
+		else if(element->WidthMode == WIDTH_FROM_FORMAT && element->PrecisionMode == WIDTH_FROM_FORMAT &&
+		        element->Width == 0 && element->Precision == 0 && element->AllocateMode == MODE_USE_BUFFER)
+			lua_gc(L, LUA_GCCOLLECT, 0);
+		else
+		{
+			/* Incremental steps after the call, in place of collections during the call */
+			penv->GcStepSize = element->WidthMode == WIDTH_FROM_ARGUMENT ? 
+				(size_t)VA_ARG(marker, LGENCALL_WIDTH_TYPE) : element->Width;
+			penv->GcBudget = element->PrecisionMode == WIDTH_FROM_ARGUMENT ? 
+				(size_t)VA_ARG(marker, LGENCALL_WIDTH_TYPE) : element->Precision;
+			penv->fGcSteps = 1;
+			if(element->AllocateMode == MODE_FROM_STACK)
+			{
+				lua_gc(L, LUA_GCSTOP, 0);
+				penv->fGcStopped = 1;
+			}
+#ifdef LUA_GCGEN
+			else if(element->AllocateMode == MODE_ALLOCATE)
+				lua_gc(L, LUA_GCGEN, 0, 0);
+#endif
+		}
+		break;
+	case DT_FUNCTION_REF:
+		if(element->WidthMode == WIDTH_TO_OUTPUT)
+			penv->pFunctionRef = VA_ARG(marker, int*);
+		else
+		{
+			penv->FunctionRef = VA_ARG(marker, int);
+			penv->fFunctionRef = 1;
+		}
+		break;
+	case DT_ERROR_REPORT:
+		penv->Error = VA_ARG(marker, lgencall_error*);
+		break;
+	case DT_PROFILE:
+		if(element->WidthMode == WIDTH_TO_OUTPUT)
+		{
+			penv->ProfileExport = VA_ARG(marker, char**);
+			*penv->ProfileExport = NULL;
+		}
+		else
+		{
+			penv->ProfilePeriod = element->WidthMode == WIDTH_FROM_ARGUMENT ? 
+				(size_t)VA_ARG(marker, LGENCALL_WIDTH_TYPE) : element->Width;
+			if(penv->ProfilePeriod == 0)
+				penv->ProfilePeriod = PROFILE_PERIOD;
+		}
+		break;
+	case DT_MEMO:
+		if(element->WidthMode == WIDTH_TO_OUTPUT)
+			penv->MemoStats = VA_ARG(marker, lgencall_memostats*);
+		else
+		{
+			penv->MemoCapacity = element->WidthMode == WIDTH_FROM_ARGUMENT ? 
+				(size_t)VA_ARG(marker, LGENCALL_WIDTH_TYPE) : element->Width;
+			penv->MemoTtl = element->PrecisionMode == WIDTH_FROM_ARGUMENT ? 
+				(size_t)VA_ARG(marker, LGENCALL_WIDTH_TYPE) : element->Precision;
+			if(penv->MemoCapacity == 0)
+				penv->MemoCapacity = MEMO_CAPACITY;
+			penv->fMemo = 1;
+		}
+		break;
+	case DT_TRACE:
+#if LGENCALL_USE_TRACE
+		if(element->WidthMode == WIDTH_TO_OUTPUT)
+			*VA_ARG(marker, char**) = DumpTrace(penv);
+		else if(element->WidthMode == WIDTH_FROM_ARGUMENT)
+			EnableTrace(VA_ARG(marker, int) != 0);
+		else
+			EnableTrace(1);
+#else
+		luaL_error(L, "tracing is not supported (LGENCALL_USE_TRACE is 0)");
+#endif
+		break;
+	case DT_BUDGET:
+		penv->InstructionBudget = element->WidthMode == WIDTH_FROM_ARGUMENT ? 
+			(size_t)VA_ARG(marker, LGENCALL_WIDTH_TYPE) : element->Width;
+		penv->TimeBudget = element->PrecisionMode == WIDTH_FROM_ARGUMENT ? 
+			(size_t)VA_ARG(marker, LGENCALL_WIDTH_TYPE) : element->Precision;
+		break;
+	case DT_WORKER:
+#if LGENCALL_USE_FORK
+		penv->WorkerFd = VA_ARG(marker, int);
+		penv->fWorker = 1;
+#else
+		luaL_error(L, "worker processes are not supported (LGENCALL_USE_FORK is 0)");
+#endif
+		break;
+	case DT_EMIT:
+		penv->EmitFct = VA_ARG(marker, lgencall_emitCB);
+		if(element->AllocateMode == MODE_FROM_STACK)
+			penv->EmitUd = VA_ARG(marker, void*);
+		break;
+	}
+}
+
+/* Runs the collection steps requested by %G after the call, within the time budget */
+static void CollectAfterCall(tEnvironment* penv)
+{
+	lua_State* L = penv->L;
+	uint64_t start, now;
+	int cycles = 0;
+	if(!penv->fGcSteps && penv->GcStats == NULL)
+		return;
+	start = now = GetMicroseconds();
+	if(penv->fGcSteps)
+	{
+		do
+		{
+			cycles += lua_gc(L, LUA_GCSTEP, (int)MIN(penv->GcStepSize, INT_MAX));
+			now = GetMicroseconds();
+		}
+		while(cycles == 0 && now - start < penv->GcBudget);
+		/* A step restarts the collector */
+		if(penv->fGcStopped)
+			lua_gc(L, LUA_GCSTOP, 0);
+	}
+	if(penv->GcStats)
+	{
+		penv->GcStats->memory = (size_t)lua_gc(L, LUA_GCCOUNT, 0);
+		penv->GcStats->time = (unsigned long)(now - start);
+		penv->GcStats->cycles = cycles;
+	}
+}
+
+/* On error, the samples and the collection steps are handled in their own protected call */
+static int pEndOfFailedCall(lua_State* L)
+{
+	tEnvironment* penv = (tEnvironment*)lua_touserdata(L, 1);
+	FlushProfile(penv);
+	CollectAfterCall(penv);
+	return 0;
+}
+
+static char HookKey;
+
+/* The profiler thread arms the hook of the profiled calls for a single instruction at each
+   period, so that the profiler costs nothing between two samples */
+#ifdef _WIN32
+static SRWLOCK ProfileLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE ProfileCond = CONDITION_VARIABLE_INIT;
+#define PROFILE_LOCK()   AcquireSRWLockExclusive(&ProfileLock)
+#define PROFILE_UNLOCK() ReleaseSRWLockExclusive(&ProfileLock)
+#define PROFILE_SIGNAL() WakeConditionVariable(&ProfileCond)
+#else
+static pthread_mutex_t ProfileLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ProfileCond = PTHREAD_COND_INITIALIZER;
+#define PROFILE_LOCK()   pthread_mutex_lock(&ProfileLock)
+#define PROFILE_UNLOCK() pthread_mutex_unlock(&ProfileLock)
+#define PROFILE_SIGNAL() pthread_cond_signal(&ProfileCond)
+#endif
+static tEnvironment* Profiled;  /* calls being profiled */
+static int fProfilerStarted;
+static int fProfilerWaiting;
+
+static void CallHook(lua_State* L, lua_Debug* ar);
+
+/* Hook of the call outside of the samples, called with ProfileLock */
+static void SetCallHook(const tEnvironment* penv)
+{
+	if(penv->HookCount)
+		lua_sethook(penv->L, CallHook, LUA_MASKCOUNT, penv->HookCount);
+	else
+		lua_sethook(penv->L, NULL, 0, 0);
+}
+
+/* Count hook installed during a call with a budget, and armed by the profiler thread for %P.
+   It only costs a registry access every HOOK_PERIOD instructions, and calls without %B have
+   no hook at all between two samples. */
+static void CallHook(lua_State* L, lua_Debug* ar)
+{
+	tEnvironment* penv;
+	int farmed, fsample;
+	(void)ar;
+	lua_pushlightuserdata(L, &HookKey);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	penv = (tEnvironment*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if(penv == NULL)
+		return;
+	PROFILE_LOCK();
+	farmed = lua_gethookcount(L) != penv->HookCount;
+	fsample = penv->fSampleDue;
+	penv->fSampleDue = 0;
+	if(farmed)
+		SetCallHook(penv);
+	PROFILE_UNLOCK();
+	if(fsample)
+		SampleStack(penv);
+	if(!farmed)
+		penv->Executed += penv->HookCount;
+	if((penv->InstructionBudget && penv->Executed >= penv->InstructionBudget) ||
+	   (penv->Deadline && GetMicroseconds() >= penv->Deadline))
+	{
+		penv->ErrorCode = LGENCALL_ERRBUDGET;
+		luaL_error(L, "call budget exceeded");
+	}
+}
+
+/* Waits for a signal or a delay in microseconds (none if 0), called with ProfileLock */
+static void ProfilerWait(uint64_t delay)
+{
+#ifdef _WIN32
+	SleepConditionVariableSRW(&ProfileCond, &ProfileLock, delay ? (DWORD)((delay + 999) / 1000) : INFINITE, 0);
+#else
+	struct timespec ts;
+	if(delay == 0)
+	{
+		pthread_cond_wait(&ProfileCond, &ProfileLock);
+		return;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	delay += (uint64_t)ts.tv_nsec / 1000;
+	ts.tv_sec += (time_t)(delay / 1000000);
+	ts.tv_nsec = (long)(delay % 1000000) * 1000;
+	pthread_cond_timedwait(&ProfileCond, &ProfileLock, &ts);
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI ProfilerThread(LPVOID param)
+#else
+static void* ProfilerThread(void* param)
+#endif
+{
+	uint64_t active = 0;
+	(void)param;
+	PROFILE_LOCK();
+	for(;;)
+	{
+		uint64_t now = GetMicroseconds(), next = now + PROFILE_PERIOD;
+		tEnvironment* penv;
+		for(penv=Profiled;penv;penv=penv->ProfileNext)
+		{
+			if(now >= penv->ProfileDue)
+			{
+				penv->fSampleDue = 1;
+				penv->ProfileDue = now + penv->ProfilePeriod;
+				lua_sethook(penv->L, CallHook, LUA_MASKCOUNT, 1);
+			}
+			next = MIN(next, penv->ProfileDue);
+		}
+		if(Profiled)
+			active = now;
+		/* The thread keeps ticking for a second after the last call, then sleeps until the next one */
+		if(Profiled == NULL && now - active >= 1000000)
+		{
+			fProfilerWaiting = 1;
+			ProfilerWait(0);
+			fProfilerWaiting = 0;
+		}
+		else
+			ProfilerWait(next - now);
+	}
+	return 0;
+}
+
+#ifndef _WIN32
+/* The child of a fork has no profiler thread, and must not inherit a locked mutex */
+static void ProfilerBeforeFork(void)
+{
+	PROFILE_LOCK();
+}
+
+static void ProfilerAfterForkParent(void)
+{
+	PROFILE_UNLOCK();
+}
+
+static void ProfilerAfterForkChild(void)
+{
+	pthread_mutex_init(&ProfileLock, NULL);
+	pthread_cond_init(&ProfileCond, NULL);
+	fProfilerStarted = 0;
+	fProfilerWaiting = 0;
+}
+#endif
+
+/* Registers a call with %P in the list of the profiler thread, which is started by the
+   first one. Samples are recorded in a buffer of the state, allocated once. */
+static void StartProfiler(tEnvironment* penv)
+{
+	lua_State* L = penv->L;
+	tProfileBuffer* buf;
+	lua_getfield(L, LUA_REGISTRYINDEX, PROFILE_BUFFER);
+	buf = (tProfileBuffer*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if(buf == NULL)
+	{
+		buf = (tProfileBuffer*)lua_newuserdata(L, sizeof(tProfileBuffer));
+		buf->Used = 0;
+		buf->Dropped = 0;
+		buf->NbCalls = 0;
+		lua_setfield(L, LUA_REGISTRYINDEX, PROFILE_BUFFER);
+	}
+	PROFILE_LOCK();
+	if(!fProfilerStarted)
+	{
+#ifdef _WIN32
+		HANDLE thread = CreateThread(NULL, 0, ProfilerThread, NULL, 0, NULL);
+		fProfilerStarted = thread != NULL;
+		if(thread)
+			CloseHandle(thread);
+#else
+		static int fAtFork;
+		pthread_t thread;
+		fProfilerStarted = pthread_create(&thread, NULL, ProfilerThread, NULL) == 0;
+		if(fProfilerStarted)
+			pthread_detach(thread);
+		if(fProfilerStarted && !fAtFork)
+			fAtFork = pthread_atfork(ProfilerBeforeFork, ProfilerAfterForkParent, ProfilerAfterForkChild) == 0;
+#endif
+		if(!fProfilerStarted)
+		{
+			PROFILE_UNLOCK();
+			luaL_error(L, "cannot start the profiler thread");
+		}
+	}
+	/* Samples left by a failed call are dropped by the next one */
+	if(buf->NbCalls == 0)
+		buf->Used = 0;
+	buf->NbCalls++;
+	penv->ProfileBuffer = buf;
+	penv->ProfileStart = buf->Used;
+	penv->fSampleDue = 0;
+	penv->ProfileDue = GetMicroseconds() + penv->ProfilePeriod;
+	penv->ProfileNext = Profiled;
+	Profiled = penv;
+	penv->fProfiled = 1;
+	if(fProfilerWaiting)
+		PROFILE_SIGNAL();
+	PROFILE_UNLOCK();
+}
+
+static int HasHook(const tEnvironment* penv)
+{
+	return penv->InstructionBudget || penv->TimeBudget || penv->ProfilePeriod;
+}
+
+static void StartHook(tEnvironment* penv)
+{
+	lua_State* L = penv->L;
+	size_t count = 0;
+	penv->PrevHook = lua_gethook(L);
+	penv->PrevHookMask = lua_gethookmask(L);
+	penv->PrevHookCount = lua_gethookcount(L);
+	lua_pushlightuserdata(L, &HookKey);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	penv->PrevHookEnv = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	lua_pushlightuserdata(L, &HookKey);
+	lua_pushlightuserdata(L, penv);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+	penv->Executed = 0;
+	if(penv->InstructionBudget || penv->TimeBudget)
+		count = HOOK_PERIOD;
+	if(penv->InstructionBudget)
+		count = MIN(count, penv->InstructionBudget);
+	penv->HookCount = (int)MIN(count, INT_MAX);
+	penv->Deadline = penv->TimeBudget ? GetMicroseconds() + penv->TimeBudget : 0;
+	PROFILE_LOCK();
+	SetCallHook(penv);
+	PROFILE_UNLOCK();
+	penv->fHooked = 1;
+	if(penv->ProfilePeriod)
+		StartProfiler(penv);
+}
+
+static void StopHook(tEnvironment* penv)
+{
+	lua_State* L = penv->L;
+	if(!penv->fHooked)
+		return;
+	penv->fHooked = 0;
+	PROFILE_LOCK();
+	if(penv->fProfiled)
+	{
+		tEnvironment** pprev = &Profiled;
+		while(*pprev != penv)
+			pprev = &(*pprev)->ProfileNext;
+		*pprev = penv->ProfileNext;
+		penv->fProfiled = 0;
+		penv->ProfileBuffer->NbCalls--;
+	}
+	lua_sethook(L, penv->PrevHook, penv->PrevHookMask, penv->PrevHookCount);
+	PROFILE_UNLOCK();
+	lua_pushlightuserdata(L, &HookKey);
+	lua_pushlightuserdata(L, penv->PrevHookEnv);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+/* Function copied from lua.c */
+static int traceback (lua_State *L) {
+  lua_getfield(L, LUA_GLOBALSINDEX, "debug");
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    return 1;
+  }
+  lua_getfield(L, -1, "traceback");
+  if (!lua_isfunction(L, -1)) {
+    lua_pop(L, 2);
+    return 1;
+  }
+  lua_pushvalue(L, 1);  /* pass error message */
+  lua_pushinteger(L, 2);  /* skip this function and traceback */
+  lua_call(L, 2, 1);  /* call debug.traceback */
+  return 1;
+}
+
+
+/* Pushes the function named by a global variable or a field path like "mod.sub.fn" */
+static void PushFunctionByPath(lua_State* L, const char* path)
+{
+	const char* name = path;
+	const char* end;
+	lua_pushvalue(L, LUA_GLOBALSINDEX);
+	for(;;)
+	{
+		end = strchr(name, '.');
+		if(end == NULL)
+			end = name + strlen(name);
+		lua_pushlstring(L, name, end - name);
+		lua_gettable(L, -2);
+		lua_remove(L, -2);
+		if(*end == 0)
+			break;
+		if(!lua_istable(L, -1))
+			luaL_error(L, "'%s' is not a valid function path", path);
+		name = end + 1;
+	}
+	if(!lua_isfunction(L, -1))
+		luaL_error(L, "'%s' is not a function", path);
+}
+
+#if LGENCALL_USE_FORK
+
+/* Calls to worker processes are sent as messages, made of the size of the message,
+   followed by the number of values and the values themselves. The values of the
+   request are the script and the inputs; the reply starts with a status byte. */
+
+#define WORKER_MAX_DEPTH 32
+#define WORKER_END_TABLE 0xFF
+
+typedef struct
+{
+	lua_State* L;
+	int Idx;   /* stack index of the userdata holding the message */
+	uint8_t* Data;
+	size_t Size;
+	size_t Capacity;
+} tMessage;
+
+static void MessageInit(lua_State* L, tMessage* m)
+{
+	m->L = L;
+	m->Capacity = 256;
+	m->Data = (uint8_t*)lua_newuserdata(L, m->Capacity);
+	m->Idx = lua_gettop(L);
+	m->Size = sizeof(size_t); /* reserved for the size */
+}
+
+static void MessageAdd(tMessage* m, const void* data, size_t len)
+{
+	if(m->Size + len > m->Capacity)
+	{
+		size_t capacity = MAX(2*m->Capacity, m->Size + len);
+		uint8_t* pdata = (uint8_t*)lua_newuserdata(m->L, capacity);
+		memcpy(pdata, m->Data, m->Size);
+		lua_replace(m->L, m->Idx);
+		m->Data = pdata;
+		m->Capacity = capacity;
+	}
+	memcpy(m->Data + m->Size, data, len);
+	m->Size += len;
+}
+
+static void MessageAddValue(tMessage* m, int idx, int depth)
+{
+	lua_State* L = m->L;
+	uint8_t tag = (uint8_t)lua_type(L, idx);
+	switch(tag)
+	{
+	case LUA_TNIL:
+		MessageAdd(m, &tag, 1);
+		break;
+	case LUA_TBOOLEAN:
+	{
+		uint8_t value = (uint8_t)lua_toboolean(L, idx);
+		MessageAdd(m, &tag, 1);
+		MessageAdd(m, &value, 1);
+		break;
+	}
+	case LUA_TNUMBER:
+	{
+		lua_Number value = lua_tonumber(L, idx);
+		MessageAdd(m, &tag, 1);
+		MessageAdd(m, &value, sizeof(value));
+		break;
+	}
+	case LUA_TSTRING:
+	{
+		size_t len;
+		const char* value = lua_tolstring(L, idx, &len);
+		MessageAdd(m, &tag, 1);
+		MessageAdd(m, &len, sizeof(len));
+		MessageAdd(m, value, len);
+		break;
+	}
+	case LUA_TTABLE:
+		if(depth >= WORKER_MAX_DEPTH)
+			luaL_error(L, "table too deeply nested to be sent to a worker");
+		luaL_checkstack(L, 2, NULL);
+		MessageAdd(m, &tag, 1);
+		lua_pushnil(L);
+		while(lua_next(L, idx))
+		{
+			MessageAddValue(m, lua_gettop(L) - 1, depth + 1);
+			MessageAddValue(m, lua_gettop(L), depth + 1);
+			lua_pop(L, 1);
+		}
+		tag = WORKER_END_TABLE;
+		MessageAdd(m, &tag, 1);
+		break;
+	default:
+		luaL_error(L, "%s values cannot be sent to a worker", luaL_typename(L, idx));
+	}
+}
+
+static void MessageRead(lua_State* L, const uint8_t** ppos, const uint8_t* end, void* data, size_t len)
+{
+	if((size_t)(end - *ppos) < len)
+		luaL_error(L, "truncated worker message");
+	memcpy(data, *ppos, len);
+	*ppos += len;
+}
+
+static void MessagePushValue(lua_State* L, const uint8_t** ppos, const uint8_t* end, int depth)
+{
+	uint8_t tag;
+	MessageRead(L, ppos, end, &tag, 1);
+	luaL_checkstack(L, 3, NULL);
+	switch(tag)
+	{
+	case LUA_TNIL:
+		lua_pushnil(L);
+		break;
+	case LUA_TBOOLEAN:
+		MessageRead(L, ppos, end, &tag, 1);
+		lua_pushboolean(L, tag);
+		break;
+	case LUA_TNUMBER:
+	{
+		lua_Number value;
+		MessageRead(L, ppos, end, &value, sizeof(value));
+		lua_pushnumber(L, value);
+		break;
+	}
+	case LUA_TSTRING:
+	{
+		size_t len;
+		MessageRead(L, ppos, end, &len, sizeof(len));
+		if((size_t)(end - *ppos) < len)
+			luaL_error(L, "truncated worker message");
+		lua_pushlstring(L, (const char*)*ppos, len);
+		*ppos += len;
+		break;
+	}
+	case LUA_TTABLE:
+		if(depth >= WORKER_MAX_DEPTH)
+			luaL_error(L, "invalid worker message");
+		lua_newtable(L);
+		while(*ppos < end && **ppos != WORKER_END_TABLE)
+		{
+			MessagePushValue(L, ppos, end, depth + 1);
+			MessagePushValue(L, ppos, end, depth + 1);
+			lua_rawset(L, -3);
+		}
+		MessageRead(L, ppos, end, &tag, 1);
+		break;
+	default:
+		luaL_error(L, "invalid worker message");
+	}
+}
+
+/* Without MSG_NOSIGNAL, the sockets are created with SO_NOSIGPIPE, so that writing
+   to a dead worker fails with EPIPE instead of raising SIGPIPE */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static int WriteAll(int fd, const void* data, size_t len)
+{
+	const uint8_t* pdata = (const uint8_t*)data;
+	while(len)
+	{
+		ssize_t res = send(fd, pdata, len, MSG_NOSIGNAL);
+		if(res < 0 && errno == EINTR)
+			continue;
+		if(res <= 0)
+			return -1;
+		pdata += res;
+		len -= (size_t)res;
+	}
+	return 0;
+}
+
+static int ReadAll(int fd, void* data, size_t len)
+{
+	uint8_t* pdata = (uint8_t*)data;
+	while(len)
+	{
+		ssize_t res = recv(fd, pdata, len, 0);
+		if(res < 0 && errno == EINTR)
+			continue;
+		if(res <= 0)
+			return -1;
+		pdata += res;
+		len -= (size_t)res;
+	}
+	return 0;
+}
+
+static int MessageSend(tMessage* m, int fd)
+{
+	size_t len = m->Size - sizeof(size_t);
+	memcpy(m->Data, &len, sizeof(len));
+	return WriteAll(fd, m->Data, m->Size);
+}
+
+/* Reads the content of a message into a new userdata. Returns NULL on end of stream. */
+static const uint8_t* MessageReceive(lua_State* L, int fd, size_t* plen)
+{
+	uint8_t* data;
+	if(ReadAll(fd, plen, sizeof(size_t)))
+		return NULL;
+	data = (uint8_t*)lua_newuserdata(L, *plen);
+	if(ReadAll(fd, data, *plen))
+		return NULL;
+	return data;
+}
+
+/* Replaces the chunk function when the call is sent to a worker with %W */
+static int RemoteCall(lua_State* L)
+{
+	int i, nbargs = lua_gettop(L);
+	int fd = (int)lua_tointeger(L, lua_upvalueindex(1));
+	uint32_t count = (uint32_t)nbargs + 1;
+	const uint8_t *pos, *end;
+	uint8_t status;
+	size_t len;
+	tMessage m;
+	MessageInit(L, &m);
+	MessageAdd(&m, &count, sizeof(count));
+	MessageAddValue(&m, lua_upvalueindex(2), 0);
+	for(i=1;i<=nbargs;i++)
+		MessageAddValue(&m, i, 0);
+	/* After a partial message, the stream cannot be used anymore: the socket is shut down,
+	   so that next calls fail at once, and the caller still has to close it */
+	if(MessageSend(&m, fd))
+	{
+		shutdown(fd, SHUT_RDWR);
+		luaL_error(L, "cannot send call to worker %d", fd);
+	}
+	lua_settop(L, 0);
+	pos = MessageReceive(L, fd, &len);
+	if(pos == NULL)
+	{
+		shutdown(fd, SHUT_RDWR);
+		luaL_error(L, "no reply from worker %d", fd);
+	}
+	end = pos + len;
+	MessageRead(L, &pos, end, &status, 1);
+	MessageRead(L, &pos, end, &count, sizeof(count));
+	for(i=0;i<(int)count;i++)
+		MessagePushValue(L, &pos, end, 0);
+	if(status)
+		lua_error(L);
+	return (int)count;
+}
+
+#endif
+
+static void PushFunction(const tEnvironment* penv, const char* script)
+{
+	lua_State* L = penv->L;
+#if LGENCALL_USE_FORK
+	if(penv->fWorker)
+	{
+		if(penv->fFunctionRef || penv->pFunctionRef || penv->EmitFct)
+			luaL_error(L, "%%W directive cannot be combined with %%R or %%E");
+		lua_pushinteger(L, penv->WorkerFd);
+		lua_pushstring(L, script);
+		lua_pushcclosure(L, RemoteCall, 2);
+		return;
+	}
+#endif
+	if(penv->fFunctionRef)
+	{
+		lua_rawgeti(L, LUA_REGISTRYINDEX, penv->FunctionRef);
+		if(!lua_isfunction(L, -1))
+			luaL_error(L, "invalid function reference %d", penv->FunctionRef);
+		return;
+	}
+	if(penv->pFunctionRef)
+	{
+		PushFunctionByPath(L, script);
+		lua_pushvalue(L, -1);
+		*penv->pFunctionRef = luaL_ref(L, LUA_REGISTRYINDEX);
+		return;
+	}
+	lua_getfield(L, LUA_REGISTRYINDEX, COMPILED_TABLE);
+	if(!lua_istable(L, -1))
+	{
+		lua_createtable(L, 0, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, COMPILED_TABLE);
+	}
+	lua_getfield(L, -1, script);
+	if(!lua_isfunction(L, -1))
+	{
+		if(!LoadFromStore(L, script))
+		{
+			if(luaL_loadstring(L, script))
+				lua_error(L);
+			SaveToStore(L, script);
+		}
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -4, script);
+	}
+}
+
+/* The emit function given to scripts in streaming mode: each call converts its
+   arguments with the output elements, then calls the user callback */
+static int EmitValues(lua_State* L)
+{
+	int i;
+	tEnvironment env;
+	const tEnvironment* penv = *(tEnvironment**)lua_touserdata(L, lua_upvalueindex(1));
+	if(penv == NULL)
+		return luaL_error(L, "emit function called outside of its generic call");
+	env = *penv;
+	env.L = L; /* emit may be called from a coroutine */
+	lua_settop(L, env.NbOutputs);
+	for(i=0;i<env.NbOutputs;i++)
+		LuaValueToPointer(&env, i+1, env.Outputs[i].Pointer, env.Outputs + i);
+	lua_pushboolean(L, (*env.EmitFct)(L, env.EmitUd));
+	return 1;
+}
+
+/* Result cache of %H. The key is made of the script, the format and the bytes of
+   the inputs; the entry keeps the bytes written into the outputs, which are copied
+   back on a hit without running the chunk. Entries are allocated with the allocation
+   function of the state, in a userdata of the registry which frees them when collected. */
+
+typedef struct tMemoEntry
+{
+	struct tMemoEntry* Next;   /* in the hash bucket */
+	struct tMemoEntry* Newer;
+	struct tMemoEntry* Older;
+	uint32_t Hash;
+	uint64_t Time;             /* creation time in microseconds */
+	size_t KeySize;
+	size_t OutputSize;
+	uint8_t Data[1];           /* key, then outputs */
+} tMemoEntry;
+
+typedef struct
+{
+	lua_Alloc AllocFct;
+	void* AllocUd;
+	tMemoEntry* Buckets[MEMO_BUCKETS];
+	tMemoEntry* Newest;
+	tMemoEntry* Oldest;
+	size_t Capacity;
+	uint64_t Ttl;              /* in microseconds */
+	lgencall_memostats Stats;
+} tMemoCache;
+
+typedef struct
+{
+	void* Pointer;
+	size_t Size;
+} tMemoOutput;
+
+/* Key and outputs of the current call */
+typedef struct tMemoCall
+{
+	tMemoCache* Cache;
+	lua_State* L;
+	uint8_t* Key;
+	size_t KeySize;
+	size_t KeyCapacity;
+	uint32_t Hash;
+	int NbOutputs;
+	tMemoOutput Outputs[MEMO_MAX_OUTPUTS];
+	uint8_t Buffer[MEMO_KEY_SIZE];
+} tMemoCall;
+
+static void MemoRemove(tMemoCache* cache, tMemoEntry* entry)
+{
+	tMemoEntry** pentry = cache->Buckets + entry->Hash % MEMO_BUCKETS;
+	while(*pentry != entry)
+		pentry = &(*pentry)->Next;
+	*pentry = entry->Next;
+	if(entry->Newer)
+		entry->Newer->Older = entry->Older;
+	else
+		cache->Newest = entry->Older;
+	if(entry->Older)
+		entry->Older->Newer = entry->Newer;
+	else
+		cache->Oldest = entry->Newer;
+	(*cache->AllocFct)(cache->AllocUd, entry, sizeof(tMemoEntry) + entry->KeySize + entry->OutputSize, 0);
+	cache->Stats.entries--;
+}
+
+static void MemoInsertNewest(tMemoCache* cache, tMemoEntry* entry)
+{
+	entry->Newer = NULL;
+	entry->Older = cache->Newest;
+	if(cache->Newest)
+		cache->Newest->Newer = entry;
+	else
+		cache->Oldest = entry;
+	cache->Newest = entry;
+}
+
+static int MemoGc(lua_State* L)
+{
+	tMemoCache* cache = (tMemoCache*)lua_touserdata(L, 1);
+	while(cache->Oldest)
+		MemoRemove(cache, cache->Oldest);
+	return 0;
+}
+
+static tMemoCache* GetMemoCache(const tEnvironment* penv, int fcreate)
+{
+	lua_State* L = penv->L;
+	tMemoCache* cache;
+	lua_getfield(L, LUA_REGISTRYINDEX, MEMO_TABLE);
+	cache = (tMemoCache*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if(cache || !fcreate)
+		return cache;
+	cache = (tMemoCache*)lua_newuserdata(L, sizeof(tMemoCache));
+	memset(cache, 0, sizeof(tMemoCache));
+	cache->AllocFct = penv->AllocFct;
+	cache->AllocUd = penv->AllocUd;
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, MemoGc);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_setfield(L, LUA_REGISTRYINDEX, MEMO_TABLE);
+	return cache;
+}
+
+static void MemoAddKey(tMemoCall* call, const void* data, size_t len)
+{
+	if(call->KeySize + len > call->KeyCapacity)
+	{
+		size_t capacity = MAX(2*call->KeyCapacity, call->KeySize + len);
+		uint8_t* key = (uint8_t*)lua_newuserdata(call->L, capacity);
+		memcpy(key, call->Key, call->KeySize);
+		call->Key = key;
+		call->KeyCapacity = capacity;
+	}
+	memcpy(call->Key + call->KeySize, data, len);
+	call->KeySize += len;
+}
+
+static void MemoAddInput(tMemoCall* call, tElement* pelem, tVaList* marker)
+{
+	uint8_t type = (uint8_t)pelem->Type;
+	size_t len;
+	MemoAddKey(call, &type, 1);
+	if(IsArrayElement(pelem) && pelem->NbDims == 0)
+	{
+		const void* pdata = VA_ARG(marker, const void*);
+		MemoAddKey(call, &pelem->Width, sizeof(size_t));
+		MemoAddKey(call, pdata, pelem->Width * pelem->Precision);
+		return;
+	}
+	if(pelem->NbDims == 0)
+	{
+		switch(pelem->Type)
+		{
+		case BT_NUMBER:
+		case BT_INTEGER:
+		case BT_UNSIGNED:
+		{
+			lua_Number val = NumberByVARG(pelem, marker);
+			MemoAddKey(call, &val, sizeof(val));
+			return;
+		}
+		case BT_BOOLEAN:
+			type = (uint8_t)(VA_ARG(marker, int) != 0);
+			MemoAddKey(call, &type, 1);
+			return;
+		case BT_NIL:
+			return;
+		case BT_STRING:
+		{
+			const void* str = VA_ARG(marker, const void*);
+			len = pelem->Width;
+			if(str == NULL)
+				len = (size_t)-1;
+#if LGENCALL_USE_WIDESTRING
+			else if(len == 0 && pelem->Precision == sizeof(wchar_t))
+				len = wcslen((const wchar_t*)str);
+#endif
+			else if(len == 0)
+				len = strlen((const char*)str);
+			MemoAddKey(call, &len, sizeof(len));
+			if(str)
+				MemoAddKey(call, str, len * pelem->Precision);
+			return;
+		}
+		default:
+			break;
+		}
+	}
+	luaL_error(call->L, "argument #%d cannot be memoized", pelem->ArgumentNb);
+}
+
+static void MemoAddOutput(tMemoCall* call, tElement* pelem, tVaList* marker)
+{
+	size_t size;
+	void* ptr;
+	if(pelem->Type == BT_NIL)
+		return;
+	ptr = VA_ARG(marker, void*);
+	if(call->NbOutputs + 2 > MEMO_MAX_OUTPUTS)
+		luaL_error(call->L, "too many outputs to be memoized");
+	if(pelem->WidthMode == WIDTH_TO_OUTPUT)
+	{
+		call->Outputs[call->NbOutputs].Pointer = pelem->Pointer2;
+		call->Outputs[call->NbOutputs++].Size = sizeof(LGENCALL_WIDTH_TYPE);
+	}
+	switch(pelem->Type)
+	{
+	case BT_NUMBER:
+	case BT_INTEGER:
+	case BT_UNSIGNED:
+	case BT_BOOLEAN:
+	case BT_STRING:
+		size = pelem->Precision;
+		if(IsArrayElement(pelem) || pelem->Type == BT_STRING)
+			size *= pelem->Width;
+		if(pelem->AllocateMode != MODE_USE_BUFFER || pelem->NbDims != 0)
+			luaL_error(call->L, "output argument #%d cannot be memoized", pelem->ArgumentNb);
+		break;
+	default:
+		luaL_error(call->L, "output argument #%d cannot be memoized", pelem->ArgumentNb);
+		return;
+	}
+	/* The sizes are part of the key, so that a hit never copies more than was stored */
+	MemoAddKey(call, &size, sizeof(size));
+	call->Outputs[call->NbOutputs].Pointer = ptr;
+	call->Outputs[call->NbOutputs++].Size = size;
+}
+
+/* Parses the format with a copy of the arguments to build the key, then fills the
+   outputs if the result is in the cache. Returns 1 on a hit. */
+static int MemoLookup(const tEnvironment* penv, const char* script, const char* format, 
+                      tVaList* marker, tMemoCall* call)
+{
+	lua_State* L = penv->L;
+	tMemoCache* cache = GetMemoCache(penv, 1);
+	tDimension dims[MAX_DIMENSIONS];
+	eDirection direction = DIR_INPUT;
+	unsigned int nbparams[2] = {0,0};
+	tElement element;
+	tMemoEntry* entry;
+	const uint8_t* pdata;
+	int i;
+	cache->Capacity = penv->MemoCapacity;
+	cache->Ttl = (uint64_t)penv->MemoTtl * 1000;
+	while(cache->Stats.entries > cache->Capacity)
+	{
+		MemoRemove(cache, cache->Oldest);
+		cache->Stats.evictions++;
+	}
+	call->Cache = cache;
+	call->L = L;
+	call->Key = call->Buffer;
+	call->KeySize = 0;
+	call->KeyCapacity = MEMO_KEY_SIZE;
+	call->NbOutputs = 0;
+	MemoAddKey(call, script, strlen(script) + 1);
+	MemoAddKey(call, format, strlen(format) + 1);
+	while(*format)
+	{
+		if(*format == '>')
+		{
+			format++;
+			direction = DIR_OUTPUT;
+			continue;
+		}
+		memset(&element, 0, sizeof(tElement));
+		element.Direction = direction;
+		element.ArgumentNb = ++nbparams[direction];
+		element.Dims = dims;
+		format = GetNextElement(penv, format, &element);
+		CheckAndRetrieveWidth(L, &element, marker);
+		if(direction == DIR_INPUT)
+			MemoAddInput(call, &element, marker);
+		else
+			MemoAddOutput(call, &element, marker);
+	}
+	call->Hash = HashBytes(call->Key, call->KeySize);
+	for(entry=cache->Buckets[call->Hash % MEMO_BUCKETS];entry;entry=entry->Next)
+		if(entry->Hash == call->Hash && entry->KeySize == call->KeySize && 
+		   memcmp(entry->Data, call->Key, call->KeySize) == 0)
+			break;
+	if(entry && cache->Ttl && GetMicroseconds() - entry->Time > cache->Ttl)
+	{
+		MemoRemove(cache, entry);
+		cache->Stats.evictions++;
+		entry = NULL;
+	}
+	if(entry == NULL)
+	{
+		cache->Stats.misses++;
+		return 0;
+	}
+	pdata = entry->Data + entry->KeySize;
+	for(i=0;i<call->NbOutputs;i++)
+	{
+		memcpy(call->Outputs[i].Pointer, pdata, call->Outputs[i].Size);
+		pdata += call->Outputs[i].Size;
+	}
+	/* Moves the entry to the head of the LRU list */
+	if(entry != cache->Newest)
+	{
+		if(entry->Older)
+			entry->Older->Newer = entry->Newer;
+		else
+			cache->Oldest = entry->Newer;
+		entry->Newer->Older = entry->Older;
+		MemoInsertNewest(cache, entry);
+	}
+	cache->Stats.hits++;
+	return 1;
+}
+
+/* Stores the outputs converted by the call. Allocation failures are ignored. */
+static void MemoStore(tMemoCall* call)
+{
+	tMemoCache* cache = call->Cache;
+	tMemoEntry* entry;
+	size_t size = 0;
+	uint8_t* pdata;
+	int i;
+	for(i=0;i<call->NbOutputs;i++)
+		size += call->Outputs[i].Size;
+	entry = (tMemoEntry*)(*cache->AllocFct)(cache->AllocUd, NULL, 0, sizeof(tMemoEntry) + call->KeySize + size);
+	if(entry == NULL)
+		return;
+	entry->Hash = call->Hash;
+	entry->Time = cache->Ttl ? GetMicroseconds() : 0;
+	entry->KeySize = call->KeySize;
+	entry->OutputSize = size;
+	memcpy(entry->Data, call->Key, call->KeySize);
+	pdata = entry->Data + call->KeySize;
+	for(i=0;i<call->NbOutputs;i++)
+	{
+		memcpy(pdata, call->Outputs[i].Pointer, call->Outputs[i].Size);
+		pdata += call->Outputs[i].Size;
+	}
+	entry->Next = cache->Buckets[entry->Hash % MEMO_BUCKETS];
+	cache->Buckets[entry->Hash % MEMO_BUCKETS] = entry;
+	MemoInsertNewest(cache, entry);
+	if(++cache->Stats.entries > cache->Capacity)
+	{
+		MemoRemove(cache, cache->Oldest);
+		cache->Stats.evictions++;
+	}
+}
+
+static void FillMemoStats(const tEnvironment* penv)
+{
+	const tMemoCache* cache;
+	if(penv->MemoStats == NULL)
+		return;
+	cache = GetMemoCache(penv, 0);
+	if(cache)
+		*penv->MemoStats = cache->Stats;
+	else
+		memset(penv->MemoStats, 0, sizeof(lgencall_memostats));
+}
+
+/* Results of the directives filled after the call */
+static void EndOfCall(tEnvironment* penv)
+{
+	FillMemoStats(penv);
+	FlushProfile(penv);
+	if(penv->ProfileExport)
+		*penv->ProfileExport = ExportProfile(penv, penv->Script);
+	CollectAfterCall(penv);
+}
+
+static void genericcallA(tEnvironment* penv, const char* script, const char* format, tVaList* marker)
+{
+	tElement* element;
+	int i;
+	eDirection direction = DIR_INPUT;
+	int nbparams[2] = {0,0};
+	lua_State* L = penv->L;
+	int idxbase, idxtrace;
+	size_t nbdims = 0;
+	tDimension* dims;
+	tMemoCall memo;
+
+	if(format == NULL)
+		format = "";
+	penv->Script = script ? script : "";
+	penv->RowIterators = NULL;
+	TRACE_BEGIN(TP_FORMAT);
+	penv->ErrorCode = LGENCALL_ERRFORMAT;
+	if(strchr(format, '<'))
+	{
+		tElement element;
+		while(*format != '<')
+		{
+			memset(&element, 0, sizeof(tElement));
+			format = GetNextElement(penv, format, &element);
+			EnvironmentParameter(penv, &element, marker);
+			if(penv->fNeedRestart)
+				return;
+		}
+		format++;
+	}
+	if((script == NULL || *script == 0) && !penv->fFunctionRef)
+	{
+		TRACE_END(TP_FORMAT);
+		EndOfCall(penv);
+		return;
+	}
+	if(penv->fMemo)
+	{
+		tVaList copy;
+		if(penv->fFunctionRef || penv->pFunctionRef || penv->EmitFct)
+			luaL_error(L, "%%H directive cannot be combined with %%R or %%E");
+		VA_COPY(copy, *marker);
+		i = MemoLookup(penv, script, format, &copy, &memo);
+		VA_END(copy);
+		if(i)
+		{
+			TRACE_END(TP_FORMAT);
+			EndOfCall(penv);
+			return;
+		}
+		penv->Memo = &memo;
+	}
+	for(i=0;format[i];i++)
+	{
+		if(format[i] == '%')
+			penv->NbElements++;
+		else if(format[i] == ',')
+			nbdims++;
+	}
+	/* Each element with a shape uses one more dimension than its commas */
+	nbdims += penv->NbElements;
+	penv->Elements = (tElement*)lua_newuserdata(L, penv->NbElements*sizeof(tElement) + nbdims*sizeof(tDimension));
+	memset(penv->Elements, 0, penv->NbElements*sizeof(tElement));
+	element = penv->Elements;
+	dims = (tDimension*)(penv->Elements + penv->NbElements);
+
+	/* In protected mode, the error handler of the enclosing lua_pcall adds the traceback */
+	idxtrace = 0;
+	if(!penv->fProtected || penv->EmitFct)
+	{
+		lua_pushcfunction(L, traceback);
+		idxtrace = lua_gettop(L);
+	}
+
+	TRACE_END(TP_FORMAT);
+
+	TRACE_BEGIN(TP_COMPILE);
+	penv->ErrorCode = LGENCALL_ERRSCRIPT;
+	PushFunction(penv, script);
+	idxbase = lua_gettop(L);
+	penv->IdxFunction = idxbase;
+	TRACE_END(TP_COMPILE);
+
+	TRACE_BEGIN(TP_PUSH);
+
+	for(;*format;)
+	{
+		if(*format == '>')
+		{
+			format++;
+			direction = DIR_OUTPUT;
+			continue;
+		}
+		if(element - penv->Elements >= penv->NbElements)
+			luaL_error(L, "overlong format string");
+		element->Direction = direction;
+		element->ArgumentNb = ++nbparams[direction];
+		element->Dims = dims;
+		penv->ErrorCode = LGENCALL_ERRFORMAT;
+		penv->ArgumentNb = element->ArgumentNb;
+		penv->Direction = direction;
+		format = GetNextElement(penv, format, element);
+		penv->ErrorCode = LGENCALL_ERRARGUMENT;
+		dims += element->NbDims;
+		CheckAndRetrieveWidth(L, element, marker);
+		if(element->NbDims)
+			CheckArrayShape(L, element);
+		if(direction == DIR_INPUT)
+		{
+			if(element->Type == BT_ROWS)
+				PushRowIterator(penv, element, marker);
+			else
+			{
+				if(element->AllocateMode == MODE_FROM_STACK && 
+				   (IsArrayElement(element) || element->Type == BT_STRING_LIST))
+					PushReusedTable(penv, element);
+				PushValueByVARG(L, element, marker);
+			}
+		}
+		else if(element->Type == BT_ROWS)
+			luaL_error(L, "argument #%d: rows iterator only allowed for input parameter", element->ArgumentNb);
+		else if(element->Type != BT_NIL)
+			element->Pointer = VA_ARG(marker, void*);
+		element++;
+	}
+	idxbase = penv->IdxFunction; /* after the row iterators */
+	TRACE_END(TP_PUSH);
+
+	penv->ErrorCode = LGENCALL_ERRRUN;
+	penv->ArgumentNb = 0;
+	if(penv->EmitFct)
+	{
+		const tEnvironment** pemit = (const tEnvironment**)lua_newuserdata(L, sizeof(tEnvironment*));
+		*pemit = penv;
+		lua_pushvalue(L, -1);
+		lua_insert(L, idxbase); /* keeps the userdata alive after the call */
+		lua_pushcclosure(L, EmitValues, 1);
+		penv->Outputs = penv->Elements + nbparams[0];
+		penv->NbOutputs = nbparams[1];
+		if(HasHook(penv))
+			StartHook(penv);
+		TRACE_BEGIN(TP_CALL);
+		i = lua_pcall(L, nbparams[0]+1, 0, idxtrace);
+		TRACE_END(TP_CALL);
+		StopHook(penv);
+		EndRowIterators(penv);
+		*pemit = NULL;
+		if(i)
+			lua_error(L);
+		EndOfCall(penv);
+		return;
+	}
+
+	if(HasHook(penv))
+		StartHook(penv);
+	TRACE_BEGIN(TP_CALL);
+	if(penv->fProtected)
+		lua_call(L, nbparams[0], nbparams[1]); /* the hook is removed by ProtectedCall on error */
+	else if(lua_pcall(L, nbparams[0], nbparams[1], idxtrace))
+	{
+		StopHook(penv);
+		EndRowIterators(penv);
+		lua_error(L);
+	}
+	TRACE_END(TP_CALL);
+	StopHook(penv);
+	EndRowIterators(penv);
+	TRACE_BEGIN(TP_OUTPUT);
+	penv->ErrorCode = LGENCALL_ERRARGUMENT;
+	penv->Direction = DIR_OUTPUT;
+	for(i=0;i<nbparams[1];i++)
+	{
+		element = penv->Elements + nbparams[0] + i;
+		penv->ArgumentNb = i+1;
+		LuaValueToPointer(penv, i+idxbase, element->Pointer, element);
+	}
+	TRACE_END(TP_OUTPUT);
+	if(penv->Memo)
+		MemoStore(penv->Memo);
+	EndOfCall(penv);
+}
+
+static void FillEnvironment(lua_State* L, tEnvironment* env)
+{
+	if(env->fNeedRestart)
+		TRACE_CLOSE(env->TraceDepth);
+	else
+		env->TraceDepth = TRACE_DEPTH();
+	TRACE_BEGIN(TP_SETUP);
+	env->fRestarted = env->fNeedRestart;
+	if(L == NULL)
+	{
+		if(env->fNeedRestart)
+			lua_close(env->L);
+		if(env->AllocFct)
+			L = lua_newstate(env->AllocFct, env->AllocUd);
+		else
+			L = luaL_newstate();
+		env->fOpenState = 1;
+		env->fCloseState = 1;
+	}
+	env->fNeedRestart = 0;
+	env->L = L;
+	env->AllocFct = lua_getallocf(L, &env->AllocUd);
+	TRACE_END(TP_SETUP);
+}
+
+/* Fills the error report of the %X directive. On error, the message is copied or
+   transcoded into the caller buffer if there is one, and this buffer is returned. */
+static void* FillErrorReport(tEnvironment* env, int errcode, int fwide)
+{
+	lgencall_error* err = env->Error;
+	const char* msg;
+	size_t len;
+	err->code = errcode == 0 ? LGENCALL_OK : errcode == LUA_ERRMEM ? LGENCALL_ERRMEM :
+	            env->ErrorCode ? env->ErrorCode : LGENCALL_ERRRUN;
+	err->argument = errcode ? env->ArgumentNb : 0;
+	err->direction = env->Direction;
+	if(errcode == 0 || err->message == NULL || err->size == 0)
+		return NULL;
+	msg = lua_tolstring(env->L, -1, &len);
+	if(msg == NULL)
+	{
+		msg = "(error object is not a string)";
+		len = strlen(msg);
+	}
+#if LGENCALL_USE_WIDESTRING
+	if(fwide)
+	{
+		WideBufferFromString(msg, len, (wchar_t*)err->message, err->size);
+		return err->message;
+	}
+#endif
+	len = MIN(len, err->size - 1);
+	memcpy(err->message, msg, len);
+	((char*)err->message)[len] = 0;
+	return err->message;
+}
+
+static char* GetErrorAndClose(tEnvironment* env, int errcode, int fwide)
+{
+	char* res = NULL;
+	TRACE_CLOSE(env->TraceDepth);
+	if(env->Error)
+		res = (char*)FillErrorReport(env, errcode, fwide);
+	if(errcode && res == NULL)
+	{
+		size_t len;
+		const char* errtmp;
+#if LGENCALL_USE_WIDESTRING
+		if(fwide)
+			LuaStringToWideString(env->L, -1);
+#endif
+		errtmp = lua_tolstring(env->L, -1, &len);
+		if(env->fCloseState)
+		{
+			res = (char*)MemoryAllocate(env, len+1);
+			memcpy(res, errtmp, len+1);
+		}
+		else
+			res = (char*)errtmp;
+	}
+	if(env->fCloseState)
+	{
+		TRACE_BEGIN(TP_CLOSE);
+		lua_close(env->L);
+		TRACE_END(TP_CLOSE);
+	}
+	return res;
+}
+
+LUALIB_API void lua_gencallA(lua_State* L, const char* script, const char* format, ...)
+{
+	tEnvironment env;
+	tVaList marker;
+	memset(&env, 0, sizeof(tEnvironment));
+	do
+	{
+		FillEnvironment(L, &env);
+		VA_START(marker, format);
+		lua_settop(env.L, 0);
+		genericcallA(&env, script, format, &marker);
+		va_end(marker.List);
+	}
+	while(env.fNeedRestart);
+	GetErrorAndClose(&env, 0, 0);
+}
+
+/* Registry keys of the C functions used by protected calls */
+static char TracebackKey, GenericCallAKey;
+#if LGENCALL_USE_WIDESTRING
+static char GenericCallWKey;
+#endif
+
+typedef struct
+{
+	void* Key;
+	lua_CFunction Fct;
+} tRegistration;
+
+static int RegisterFunctions(lua_State* L)
+{
+	const tRegistration* reg = (const tRegistration*)lua_topointer(L, 1);
+	lua_pushlightuserdata(L, &TracebackKey);
+	lua_pushcfunction(L, traceback);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+	lua_pushlightuserdata(L, reg->Key);
+	lua_pushcfunction(L, reg->Fct);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+	return 0;
+}
+
+/* Runs a generic call function within a single protected call, with a traceback handler.
+   Both functions are created once and kept in the registry, so that unlike lua_cpcall,
+   nothing is allocated after the first call. */
+static int ProtectedCall(tEnvironment* penv, void* key, lua_CFunction fct, void* params)
+{
+	lua_State* L = penv->L;
+	int res;
+	lua_pushlightuserdata(L, &TracebackKey);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	lua_pushlightuserdata(L, key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if(!lua_isfunction(L, -1) || !lua_isfunction(L, -2))
+	{
+		tRegistration reg;
+		lua_pop(L, 2);
+		reg.Key = key;
+		reg.Fct = fct;
+		res = lua_cpcall(L, RegisterFunctions, &reg);
+		if(res)
+			return res;
+		lua_pushlightuserdata(L, &TracebackKey);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		lua_pushlightuserdata(L, key);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+	}
+	lua_pushlightuserdata(L, params);
+	penv->fProtected = 1;
+	res = lua_pcall(L, 1, 0, -3);
+	EndRowIterators(penv); /* before any allocation, the iterators being unreachable on error */
+	StopHook(penv);
+	/* The steps of %G are also due after a failed call, %+G having stopped the collector */
+	if(res && (penv->fGcSteps || penv->GcStats || penv->ProfileBuffer) && lua_cpcall(L, pEndOfFailedCall, penv))
+		lua_pop(L, 1);
+	lua_remove(L, res ? -2 : -1);
+	return res;
+}
+
+static int pgenericcallA(lua_State* L)
+{
+	tGenericCallParamsA* p = (tGenericCallParamsA*)lua_topointer(L, 1);
+	lua_settop(L, 0);
+	genericcallA(&p->Environment, p->Script, p->Format, &p->Marker);
+	return 0;
+}
+
+LUALIB_API char* lua_genpcallA(lua_State* L, const char* script, const char* format, ...)
+{
+	tGenericCallParamsA p;
+	int res;
+	memset(&p.Environment, 0, sizeof(tEnvironment));
+	do
+	{
+		FillEnvironment(L, &p.Environment);
+		VA_START(p.Marker, format);
+		p.Script = script;
+		p.Format = format;
+		res = ProtectedCall(&p.Environment, &GenericCallAKey, pgenericcallA, &p);
+		va_end(p.Marker.List);
+	}
+	while(p.Environment.fNeedRestart);
+	if(p.Environment.Error)
+		p.Environment.Error->script = script;
+	return GetErrorAndClose(&p.Environment, res, 0);
+}
+
+#if LGENCALL_USE_WIDESTRING
+typedef struct 
+{
+	const wchar_t* Script;
+	const wchar_t* Format;
+	tVaList Marker;
+	tEnvironment Environment;
+} tGenericCallParamsW;
+
+static void genericcallW(tEnvironment* penv, const wchar_t* script, const wchar_t* format, tVaList* marker)
+{
+	lua_State* L = penv->L;
+	lua_settop(L, 0);
+	if(script == NULL)
+		lua_pushstring(L, "");
+	else
+		PushWideString(L, script, 0);
+	if(format == NULL)
+		lua_pushstring(L, "");
+	else
+		PushWideString(L, format, 0);
+	penv->fWideChar = 1;
+	genericcallA(penv, lua_tostring(L, -2), lua_tostring(L, -1), marker);
+}
+
+LUALIB_API void lua_gencallW(lua_State* L, const wchar_t* script, const wchar_t* format, ...)
+{
+	tEnvironment env;
+	tVaList marker;
+	memset(&env, 0, sizeof(tEnvironment));
+	do
+	{
+		FillEnvironment(L, &env);
+		VA_START(marker, format);
+		genericcallW(&env, script, format, &marker);
+		va_end(marker.List);
+	}
+	while(env.fNeedRestart);
+	GetErrorAndClose(&env, 0, 0);
+}
+
+static int pgenericcallW(lua_State* L)
+{
+	tGenericCallParamsW* p = (tGenericCallParamsW*)lua_topointer(L, 1);
+	genericcallW(&p->Environment, p->Script, p->Format, &p->Marker);
+	return 0;
+}
+
+LUALIB_API wchar_t* lua_genpcallW(lua_State* L, const wchar_t* script, const wchar_t* format, ...)
+{
+	tGenericCallParamsW p;
+	int res;
+	memset(&p.Environment, 0, sizeof(tEnvironment));
+	do
+	{
+		FillEnvironment(L, &p.Environment);
+		VA_START(p.Marker, format);
+		p.Script = script;
+		p.Format = format;
+		res = ProtectedCall(&p.Environment, &GenericCallWKey, pgenericcallW, &p);
+		va_end(p.Marker.List);
+	}
+	while(p.Environment.fNeedRestart);
+	if(p.Environment.Error)
+		p.Environment.Error->script = script;
+	return (wchar_t*)GetErrorAndClose(&p.Environment, res, 1);
+}
+#endif
+
+#if LGENCALL_USE_FORK
+
+typedef struct
+{
+	int Fd;
+	int fStop;
+	int fReplied;
+	const char* Error;
+} tWorkerRequest;
+
+/* Runs in the protected call of the worker: chunk then inputs, returns all results */
+static int RunRequest(lua_State* L)
+{
+	tEnvironment env;
+	int top = lua_gettop(L);
+	memset(&env, 0, sizeof(tEnvironment));
+	env.L = L;
+	PushFunction(&env, lua_tostring(L, 1));
+	lua_replace(L, 1);
+	lua_settop(L, top);
+	lua_call(L, top - 1, LUA_MULTRET);
+	return lua_gettop(L);
+}
+
+static int ServeRequest(lua_State* L)
+{
+	tWorkerRequest* req = (tWorkerRequest*)lua_touserdata(L, 1);
+	const uint8_t *pos, *end;
+	uint32_t i, count;
+	uint8_t status;
+	size_t len;
+	int top;
+	tMessage m;
+	req->fReplied = 0;
+	pos = MessageReceive(L, req->Fd, &len);
+	if(pos == NULL)
+	{
+		req->fStop = 1;
+		return 0;
+	}
+	end = pos + len;
+	MessageRead(L, &pos, end, &count, sizeof(count));
+	lua_pushcfunction(L, traceback);
+	top = lua_gettop(L);
+	lua_pushcfunction(L, RunRequest);
+	for(i=0;i<count;i++)
+		MessagePushValue(L, &pos, end, 0);
+	status = (uint8_t)(lua_pcall(L, (int)count, LUA_MULTRET, top) != 0);
+	if(status && !lua_isstring(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_pushliteral(L, "(error object is not a string)");
+	}
+	count = (uint32_t)(lua_gettop(L) - top);
+	MessageInit(L, &m);
+	MessageAdd(&m, &status, 1);
+	MessageAdd(&m, &count, sizeof(count));
+	for(i=1;i<=count;i++)
+		MessageAddValue(&m, top + (int)i, 0);
+	if(MessageSend(&m, req->Fd))
+		req->fStop = 1;
+	req->fReplied = 1;
+	return 0;
+}
+
+/* Reply to a request whose results could not be sent */
+static int SendError(lua_State* L)
+{
+	tWorkerRequest* req = (tWorkerRequest*)lua_touserdata(L, 1);
+	uint8_t status = 1;
+	uint32_t count = 1;
+	tMessage m;
+	lua_pushstring(L, req->Error);
+	MessageInit(L, &m);
+	MessageAdd(&m, &status, 1);
+	MessageAdd(&m, &count, sizeof(count));
+	MessageAddValue(&m, 2, 0);
+	if(MessageSend(&m, req->Fd))
+		req->fStop = 1;
+	return 0;
+}
+
+static void ServeWorker(lua_State* L, int fd)
+{
+	tWorkerRequest req;
+	memset(&req, 0, sizeof(req));
+	req.Fd = fd;
+	while(!req.fStop)
+	{
+		lua_settop(L, 0);
+		if(lua_cpcall(L, ServeRequest, &req) == 0 || req.fStop || req.fReplied)
+			continue;
+		req.Error = lua_tostring(L, -1);
+		if(req.Error == NULL || lua_cpcall(L, SendError, &req))
+			break;
+	}
+}
+
+/* Forks worker processes which inherit the state L, with its libraries and
+   compiled chunks. Each worker serves the calls sent with %W on its socket,
+   and exits when the socket is closed. Fills fds, and pids when not NULL.
+   Returns the number of workers started. */
+LUALIB_API int lua_genfork(lua_State* L, int nbworkers, int* fds, pid_t* pids)
+{
+	int i, j;
+	fflush(NULL);
+	for(i=0;i<nbworkers;i++)
+	{
+		int sv[2];
+		pid_t pid;
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+			break;
+#ifdef SO_NOSIGPIPE
+		j = 1;
+		setsockopt(sv[0], SOL_SOCKET, SO_NOSIGPIPE, &j, sizeof(j));
+		setsockopt(sv[1], SOL_SOCKET, SO_NOSIGPIPE, &j, sizeof(j));
+#endif
+		pid = fork();
+		if(pid < 0)
+		{
+			close(sv[0]);
+			close(sv[1]);
+			break;
+		}
+		if(pid == 0)
+		{
+			for(j=0;j<i;j++)
+				close(fds[j]);
+			close(sv[0]);
+			ServeWorker(L, sv[1]);
+			_exit(0);
+		}
+		close(sv[1]);
+		fds[i] = sv[0];
+		if(pids)
+			pids[i] = pid;
+	}
+	return i;
+}
+#endif
+
+#if LGENCALL_USE_THREADS
+
+#ifdef _MSC_VER
+#define ATOMIC_EXCHANGE(p, v) InterlockedExchangePointer((PVOID volatile*)(p), (v))
+#define ATOMIC_LOAD(p)        InterlockedCompareExchangePointer((PVOID volatile*)(p), NULL, NULL)
+#define ATOMIC_STORE(p, v)    InterlockedExchangePointer((PVOID volatile*)(p), (v))
+#define ATOMIC_INCREMENT(p)   InterlockedIncrement(p)
+#else
+#define ATOMIC_EXCHANGE(p, v) __atomic_exchange_n(p, v, __ATOMIC_ACQ_REL)
+#define ATOMIC_LOAD(p)        __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v)    __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ATOMIC_INCREMENT(p)   __atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+#endif
+
+#ifdef _WIN32
+typedef HANDLE tSemaphore;
+typedef HANDLE tThread;
+
+static int SemInit(tSemaphore* sem)
+{
+	*sem = CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+	return *sem != NULL;
+}
+#define SemPost(sem)    ReleaseSemaphore(*(sem), 1, NULL)
+#define SemWait(sem)    WaitForSingleObject(*(sem), INFINITE)
+#define SemDestroy(sem) CloseHandle(*(sem))
+#define YieldThread()   SwitchToThread()
+#else
+typedef sem_t tSemaphore;
+typedef pthread_t tThread;
+
+#define SemPost(sem)    sem_post(sem)
+#define SemDestroy(sem) sem_destroy(sem)
+#define YieldThread()   sched_yield()
+
+static int SemInit(tSemaphore* sem)
+{
+	return sem_init(sem, 0, 0) == 0;
+}
+
+static void SemWait(tSemaphore* sem)
+{
+	while(sem_wait(sem) != 0 && errno == EINTR);
+}
+#endif
+
+/* Call submitted to a worker thread, followed by its arguments, the copies of
+   the input strings and arrays, the script and the format */
+typedef struct tJob
+{
+	struct tJob* Next;
+	lgencall_doneCB Fct;
+	void* Ud;
+	lgencall_future* Future;
+	const char* CallerScript;
+	const char* Script;
+	const char* Format;
+	const uint8_t* Args;
+	int fStop;
+} tJob;
+
+struct lgencall_future
+{
+	tSemaphore Done;
+	char* Error;
+};
+
+/* Each worker thread owns a state, and pops the jobs of its intrusive MPSC queue:
+   producers swap the head then link the previous job, the thread pops from the tail */
+typedef struct
+{
+	tJob* Head;
+	tJob* Tail;
+	tJob Stub;
+	tJob Stop;
+	tSemaphore Pending;   /* number of jobs pushed */
+	lua_State* L;
+	tThread Thread;
+} tWorkerThread;
+
+struct lgencall_executor
+{
+	int NbWorkers;
+	volatile long NextWorker;
+	tWorkerThread Workers[1];
+};
+
+typedef struct
+{
+	uint8_t* Args;        /* NULL while measuring the sizes */
+	uint8_t* Data;        /* copies of the input strings and arrays */
+	size_t ArgsSize;
+	size_t DataSize;
+} tMarshal;
+
+#define MARSHAL_VALUE(m, marker, type) \
+	do { type value_ = va_arg((marker)->List, type); MarshalValue(m, &value_, sizeof(type)); } while(0)
+
+static void MarshalValue(tMarshal* m, const void* value, size_t size)
+{
+	m->ArgsSize = AlignArgument(m->ArgsSize, size);
+	if(m->Args)
+		memcpy(m->Args + m->ArgsSize, value, size);
+	m->ArgsSize += size;
+}
+
+static size_t MarshalWidth(tMarshal* m, tVaList* marker)
+{
+	LGENCALL_WIDTH_TYPE width = va_arg(marker->List, LGENCALL_WIDTH_TYPE);
+	MarshalValue(m, &width, sizeof(width));
+	return (size_t)width;
+}
+
+/* Copies the data of an input pointer, and passes the pointer to the copy instead */
+static void MarshalData(tMarshal* m, const void* data, size_t size)
+{
+	const void* copy = NULL;
+	if(m->Data && data)
+	{
+		copy = m->Data + m->DataSize;
+		memcpy(m->Data + m->DataSize, data, size);
+	}
+	if(data)
+		m->DataSize = AlignArgument(m->DataSize + size, 16);
+	MarshalValue(m, &copy, sizeof(copy));
+}
+
+/* Byte size of a zero separated string list, with its final empty string */
+static size_t StringListSize(const char* psrc, const tElement* pelem)
+{
+	size_t len, total = 0, size = pelem->Precision;
+	if(pelem->Width)
+		return pelem->Width * size;
+	do
+	{
+		len = StringListItemLength(psrc + total, (size_t)-1, size);
+		total += (len + 1) * size;
+	}
+	while(len);
+	return total;
+}
+
+/* Arguments consumed by the directives, as EnvironmentParameter does */
+static void MarshalDirective(tMarshal* m, tEnvironment* penv, const tElement* element, tVaList* marker)
+{
+	switch(element->EnvType)
+	{
+	case DT_MEMORY_ALLOC:
+	case DT_CLOSE_STATE:
+	case DT_GET_STATE:
+		FormatError(penv, "%%M, %%C and %%S directives not allowed in a submitted call");
+		break;
+	case DT_FUNCTION_REF:
+		/* References belong to the state, and the worker state is chosen in turn */
+		FormatError(penv, "%%R directive not allowed in a submitted call");
+		break;
+	case DT_OPEN_LIBRARY:
+		if(element->WidthMode == WIDTH_FROM_ARGUMENT)
+			MARSHAL_VALUE(m, marker, unsigned int);
+		break;
+	case DT_CLEAR_CACHE:
+		if(element->WidthMode == WIDTH_TO_OUTPUT)
+			MARSHAL_VALUE(m, marker, void*);
+		break;
+	case DT_COLLECT_GARBAGE:
+	case DT_MEMO:
+	case DT_PROFILE:
+		if(element->WidthMode == WIDTH_TO_OUTPUT)
+		{
+			MARSHAL_VALUE(m, marker, void*);
+			break;
+		}
+		/* fallthrough - same widths as %B, except the precision of %P */
+	case DT_BUDGET:
+		if(element->WidthMode == WIDTH_FROM_ARGUMENT)
+			MarshalWidth(m, marker);
+		if(element->PrecisionMode == WIDTH_FROM_ARGUMENT && element->EnvType != DT_PROFILE)
+			MarshalWidth(m, marker);
+		break;
+	case DT_ERROR_REPORT:
+		MARSHAL_VALUE(m, marker, lgencall_error*);
+		break;
+	case DT_TRACE:
+#if LGENCALL_USE_TRACE
+		if(element->WidthMode == WIDTH_TO_OUTPUT)
+			MARSHAL_VALUE(m, marker, char**);
+		else if(element->WidthMode == WIDTH_FROM_ARGUMENT)
+			MARSHAL_VALUE(m, marker, int);
+#endif
+		break;
+	case DT_WORKER:
+#if LGENCALL_USE_FORK
+		MARSHAL_VALUE(m, marker, int);
+#endif
+		break;
+	case DT_EMIT:
+		MARSHAL_VALUE(m, marker, lgencall_emitCB);
+		if(element->AllocateMode == MODE_FROM_STACK)
+			MARSHAL_VALUE(m, marker, void*);
+		break;
+	default:
+		break;
+	}
+}
 
-	if(format == NULL)
-		format = "";
-	if(strchr(format, '<'))
+/* Arguments consumed by an input or output element, as CheckAndRetrieveWidth,
+   PushValueByVARG and genericcallA do. Input strings and arrays are copied. */
+static void MarshalElement(tMarshal* m, tEnvironment* penv, tElement* element, tVaList* marker)
+{
+	size_t i, size;
+	for(i=0;i<element->NbDims;i++)
 	{
-		tElement element;
-		while(*format != '<')
+		tDimension* dim = element->Dims + i;
+		if(dim->Count == DIM_FROM_ARGUMENT)
+			dim->Count = MarshalWidth(m, marker);
+		if(dim->Stride == DIM_FROM_ARGUMENT)
+			dim->Stride = MarshalWidth(m, marker);
+	}
+	if(element->WidthMode == WIDTH_FROM_ARGUMENT)
+		element->Width = MarshalWidth(m, marker);
+	if(element->fTrusted && element->Direction == DIR_INPUT)
+		FormatError(penv, "argument #%d: '!' character only allowed for output parameter", element->ArgumentNb);
+	if(element->WidthMode == WIDTH_TO_OUTPUT && element->Direction == DIR_INPUT)
+		FormatError(penv, "argument #%d: '&' character only allowed for output parameter", element->ArgumentNb);
+	if(element->WidthMode == WIDTH_TO_OUTPUT)
+		MARSHAL_VALUE(m, marker, void*);
+	if(element->Type == BT_CALLBACK)
+		MARSHAL_VALUE(m, marker, void*);
+	if(element->PrecisionMode == WIDTH_FROM_ARGUMENT)
+	{
+		unsigned int precision = va_arg(marker->List, unsigned int);
+		MarshalValue(m, &precision, sizeof(precision));
+		element->Precision = precision;
+	}
+	if(element->Precision == 0)
+		DefaultPrecision(element);
+	if(element->Type == BT_REFERENCE)
+		FormatError(penv, "argument #%d: references of a state not allowed in a submitted call", element->ArgumentNb);
+	if(element->Direction == DIR_OUTPUT)
+	{
+		if(element->AllocateMode == MODE_FROM_STACK)
+			FormatError(penv, "output argument #%d: '+' flag not allowed in a submitted call", element->ArgumentNb);
+		if(element->Type != BT_NIL)
+			MARSHAL_VALUE(m, marker, void*);
+		return;
+	}
+	if(element->Type == BT_ROWS || element->Type == BT_THREAD)
+		FormatError(penv, "argument #%d: rows and threads not allowed in a submitted call", element->ArgumentNb);
+	if(element->NbDims)
+	{
+		/* Extent of the array, with the default strides of CheckArrayShape */
+		size_t stride = element->Precision;
+		size = element->Precision;
+		for(i=element->NbDims;i-->0;)
 		{
-			memset(&element, 0, sizeof(tElement));
-			format = GetNextElement(penv, format, &element);
-			EnvironmentParameter(penv, &element, marker);
-			if(penv->fNeedRestart)
-				return;
+			tDimension* dim = element->Dims + i;
+			if(dim->Stride == 0)
+				dim->Stride = stride;
+			stride = dim->Count * dim->Stride;
+			size = dim->Count ? size + (dim->Count - 1) * dim->Stride : 0;
+			if(size == 0)
+				break;
 		}
-		format++;
+		MarshalData(m, va_arg(marker->List, const void*), size);
+		return;
 	}
-	if(script == NULL || *script == 0)
+	if(IsArrayElement(element))
+	{
+		MarshalData(m, va_arg(marker->List, const void*), element->Width * element->Precision);
 		return;
-	for(i=0;format[i];i++)
-		if(format[i] == '%')
-			penv->NbElements++;
-	penv->Elements = (tElement*)lua_newuserdata(L, penv->NbElements*sizeof(tElement));
-	memset(penv->Elements, 0, penv->NbElements*sizeof(tElement));
-	element = penv->Elements;
-
-	lua_pushcfunction(L, traceback);
-	idxtrace = lua_gettop(L);
-
-	lua_getfield(L, LUA_REGISTRYINDEX, COMPILED_TABLE);
-	if(!lua_istable(L, -1))
+	}
+	switch(element->Type)
 	{
-		lua_createtable(L, 0, 0);
-		lua_pushvalue(L, -1);
-		lua_setfield(L, LUA_REGISTRYINDEX, COMPILED_TABLE);
+	case BT_NUMBER:
+#if LGENCALL_USE_LONG_DOUBLE
+		if(element->Precision == sizeof(long double))
+		{
+			MARSHAL_VALUE(m, marker, long double);
+			break;
+		}
+#endif
+		MARSHAL_VALUE(m, marker, double);
+		break;
+	case BT_INTEGER:
+#if INT_MAX <= 2147483647 && LGENCALL_USE_64_BITS
+		if(element->Precision == 8)
+		{
+			MARSHAL_VALUE(m, marker, int64_t);
+			break;
+		}
+#endif
+		MARSHAL_VALUE(m, marker, int);
+		break;
+	case BT_UNSIGNED:
+#if UINT_MAX <= 4294967295u && LGENCALL_USE_64_BITS > 1
+		if(element->Precision == 8)
+		{
+			MARSHAL_VALUE(m, marker, uint64_t);
+			break;
+		}
+#endif
+		MARSHAL_VALUE(m, marker, unsigned int);
+		break;
+	case BT_BOOLEAN:
+		MARSHAL_VALUE(m, marker, int);
+		break;
+	case BT_NIL:
+		break;
+	case BT_STRING:
+	{
+		const void* str = va_arg(marker->List, const void*);
+		size = element->Width * element->Precision;
+#if LGENCALL_USE_WIDESTRING
+		if(str && size == 0 && element->Precision == sizeof(wchar_t))
+			size = (wcslen((const wchar_t*)str) + 1) * sizeof(wchar_t);
+		else
+#endif
+		if(str && size == 0)
+			size = strlen((const char*)str) + 1;
+		MarshalData(m, str, size);
+		break;
 	}
-	lua_getfield(L, -1, script);
-	if(!lua_isfunction(L, -1))
+	case BT_STRING_LIST:
 	{
-		if(luaL_loadstring(L, script))
-			lua_error(L);
-		lua_pushvalue(L, -1);
-		lua_setfield(L, -4, script);
+		const char* list = va_arg(marker->List, const char*);
+		MarshalData(m, list, list ? StringListSize(list, element) : 0);
+		break;
 	}
-	idxbase = lua_gettop(L);
+	case BT_FULL_POINTER:
+		MarshalData(m, va_arg(marker->List, const void*), element->Precision);
+		break;
+	default:
+		MARSHAL_VALUE(m, marker, void*);
+		break;
+	}
+}
 
-	for(;*format;)
+/* Walks the format like genericcallA, without a state */
+static void MarshalFormat(tMarshal* m, tEnvironment* penv, const char* format, tVaList* marker)
+{
+	tDimension dims[MAX_DIMENSIONS];
+	eDirection direction = DIR_INPUT;
+	unsigned int nbparams[2] = {0,0};
+	tElement element;
+	if(strchr(format, '<'))
+	{
+		while(*format != '<')
+		{
+			memset(&element, 0, sizeof(tElement));
+			format = GetNextElement(penv, format, &element);
+			MarshalDirective(m, penv, &element, marker);
+		}
+		format++;
+	}
+	while(*format)
 	{
 		if(*format == '>')
 		{
@@ -999,177 +4372,268 @@ static void genericcallA(tEnvironment* penv, const char* script, const char* for
 			direction = DIR_OUTPUT;
 			continue;
 		}
-		if(element - penv->Elements >= penv->NbElements)
-			luaL_error(L, "overlong format string");
-		element->Direction = direction;
-		element->ArgumentNb = ++nbparams[direction];
-		format = GetNextElement(penv, format, element);
-		CheckAndRetrieveWidth(L, element, marker);
-		if(direction == DIR_INPUT)
-			PushValueByVARG(L, element, marker);
-		else if(element->Type != BT_NIL)
-			element->Pointer = va_arg(marker->List, void*);
-		element++;
+		memset(&element, 0, sizeof(tElement));
+		element.Direction = direction;
+		element.ArgumentNb = ++nbparams[direction];
+		element.Dims = dims;
+		format = GetNextElement(penv, format, &element);
+		MarshalElement(m, penv, &element, marker);
 	}
+}
 
+/* Format errors escape through penv->Escape, out of MarshalFormat so that none of its
+   variables is live across setjmp. Returns 0 on error. */
+static int MarshalArguments(tMarshal* m, tEnvironment* penv, const char* format, tVaList* marker)
+{
+	if(setjmp(penv->Escape->Jump))
+		return 0;
+	MarshalFormat(m, penv, format, marker);
+	return 1;
+}
 
-	if(lua_pcall(L, nbparams[0], nbparams[1], idxtrace))
-		lua_error(L);
-	for(i=0;i<nbparams[1];i++)
+static void CompleteJob(lgencall_doneCB fct, void* ud, lgencall_future* future, char* error)
+{
+	if(fct)
+		(*fct)(ud, error);
+	else
 	{
-		element = penv->Elements + nbparams[0] + i;
-		LuaValueToPointer(penv, i+idxbase, element->Pointer, element);
+		future->Error = error;
+		SemPost(&future->Done);
 	}
 }
 
-static void FillEnvironment(lua_State* L, tEnvironment* env)
+/* Runs a job in the state of the worker thread, like lua_genpcallA with the copied arguments */
+static void RunJob(lua_State* L, tJob* job)
 {
-	env->fRestarted = env->fNeedRestart;
-	if(L == NULL)
+	tGenericCallParamsA p;
+	lgencall_doneCB fct = job->Fct;
+	void* ud = job->Ud;
+	lgencall_future* future = job->Future;
+	const char* msg;
+	char* error = NULL;
+	int res;
+	memset(&p.Environment, 0, sizeof(tEnvironment));
+	FillEnvironment(L, &p.Environment);
+	p.Marker.Block = job->Args;
+	p.Marker.Pos = 0;
+	p.Script = job->Script;
+	p.Format = job->Format;
+	res = ProtectedCall(&p.Environment, &GenericCallAKey, pgenericcallA, &p);
+	if(p.Environment.Error)
+		p.Environment.Error->script = job->CallerScript;
+	msg = GetErrorAndClose(&p.Environment, res, 0);
+	if(msg)
 	{
-		if(env->fNeedRestart)
-			lua_close(env->L);
-		if(env->AllocFct)
-			L = lua_newstate(env->AllocFct, env->AllocUd);
-		else
-			L = luaL_newstate();
-		env->fOpenState = 1;
-		env->fCloseState = 1;
+		size_t len = strlen(msg);
+		error = (char*)malloc(len + 1);
+		if(error)
+			memcpy(error, msg, len + 1);
 	}
-	env->fNeedRestart = 0;
-	env->L = L;
-	env->AllocFct = lua_getallocf(L, &env->AllocUd);
+	lua_settop(L, 0);
+	free(job);
+	CompleteJob(fct, ud, future, error);
 }
 
-static char* GetErrorAndClose(tEnvironment* env, int errcode)
+static void PushJob(tWorkerThread* w, tJob* job)
 {
-	char* res = NULL;
-	if(errcode)
-	{
-		size_t len;
-		const char* errtmp;
-		errtmp = lua_tolstring(env->L, -1, &len);
-		if(env->fCloseState)
-		{
-			res = (char*)MemoryAllocate(env, len+1);
-			memcpy(res, errtmp, len+1);
-		}
-		else
-			res = (char*)errtmp;
-	}
-	if(env->fCloseState)
-		lua_close(env->L);
-	return res;
+	tJob* prev;
+	job->Next = NULL;
+	prev = (tJob*)ATOMIC_EXCHANGE(&w->Head, job);
+	ATOMIC_STORE(&prev->Next, job);
 }
 
-LUALIB_API void lua_gencallA(lua_State* L, const char* script, const char* format, ...)
+/* Returns NULL if the queue is empty, or if a producer has not linked its job yet */
+static tJob* PopJob(tWorkerThread* w)
 {
-	tEnvironment env;
-	tVaList marker;
-	memset(&env, 0, sizeof(tEnvironment));
-	do
+	tJob* tail = w->Tail;
+	tJob* next = (tJob*)ATOMIC_LOAD(&tail->Next);
+	if(tail == &w->Stub)
 	{
-		FillEnvironment(L, &env);
-		va_start(marker.List, format);
-		lua_settop(env.L, 0);
-		genericcallA(&env, script, format, &marker);
-		va_end(marker.List);
+		if(next == NULL)
+			return NULL;
+		w->Tail = tail = next;
+		next = (tJob*)ATOMIC_LOAD(&next->Next);
 	}
-	while(env.fNeedRestart);
-	GetErrorAndClose(&env, 0);
+	if(next == NULL)
+	{
+		if(tail != (tJob*)ATOMIC_LOAD(&w->Head))
+			return NULL;
+		PushJob(w, &w->Stub);
+		next = (tJob*)ATOMIC_LOAD(&tail->Next);
+		if(next == NULL)
+			return NULL;
+	}
+	w->Tail = next;
+	return tail;
 }
 
-static int pgenericcallA(lua_State* L)
+#ifdef _WIN32
+static DWORD WINAPI WorkerThread(LPVOID param)
+#else
+static void* WorkerThread(void* param)
+#endif
 {
-	tGenericCallParamsA* p = (tGenericCallParamsA*)lua_topointer(L, 1);
-	lua_settop(L, 0);
-	genericcallA(&p->Environment, p->Script, p->Format, &p->Marker);
+	tWorkerThread* w = (tWorkerThread*)param;
+	for(;;)
+	{
+		tJob* job;
+		SemWait(&w->Pending);
+		while((job = PopJob(w)) == NULL)
+			YieldThread();
+		if(job->fStop)
+			break;
+		RunJob(w->L, job);
+	}
 	return 0;
 }
 
-LUALIB_API char* lua_genpcallA(lua_State* L, const char* script, const char* format, ...)
+/* Stops the worker threads after their pending jobs. The states are not closed. */
+LUALIB_API void lua_genstop(lgencall_executor* exec)
 {
-	tGenericCallParamsA p;
-	int res;
-	memset(&p.Environment, 0, sizeof(tEnvironment));
-	do
+	int i;
+	for(i=0;i<exec->NbWorkers;i++)
 	{
-		FillEnvironment(L, &p.Environment);
-		va_start(p.Marker.List, format);
-		p.Script = script;
-		p.Format = format;
-		res = lua_cpcall(p.Environment.L, pgenericcallA, &p);
-		va_end(p.Marker.List);
+		tWorkerThread* w = exec->Workers + i;
+		w->Stop.fStop = 1;
+		PushJob(w, &w->Stop);
+		SemPost(&w->Pending);
 	}
-	while(p.Environment.fNeedRestart);
-	return GetErrorAndClose(&p.Environment, res);
+	for(i=0;i<exec->NbWorkers;i++)
+	{
+		tWorkerThread* w = exec->Workers + i;
+#ifdef _WIN32
+		WaitForSingleObject(w->Thread, INFINITE);
+		CloseHandle(w->Thread);
+#else
+		pthread_join(w->Thread, NULL);
+#endif
+		SemDestroy(&w->Pending);
+	}
+	free(exec);
 }
 
-#if LGENCALL_USE_WIDESTRING
-typedef struct 
-{
-	const wchar_t* Script;
-	const wchar_t* Format;
-	tVaList Marker;
-	tEnvironment Environment;
-} tGenericCallParamsW;
-
-static void genericcallW(tEnvironment* penv, const wchar_t* script, const wchar_t* format, tVaList* marker)
+/* Starts one worker thread per state. The states must not be used by other
+   threads until lua_genstop. */
+LUALIB_API lgencall_executor* lua_genstart(lua_State** states, int nbstates)
 {
-	lua_State* L = penv->L;
-	lua_settop(L, 0);
-	if(script == NULL)
-		lua_pushstring(L, "");
-	else
-		PushWideString(L, script, 0);
-	if(format == NULL)
-		lua_pushstring(L, "");
-	else
-		PushWideString(L, format, 0);
-	penv->fWideChar = 1;
-	genericcallA(penv, lua_tostring(L, -2), lua_tostring(L, -1), marker);
+	lgencall_executor* exec;
+	int i;
+	if(nbstates <= 0)
+		return NULL;
+	exec = (lgencall_executor*)calloc(1, sizeof(lgencall_executor) + (nbstates - 1)*sizeof(tWorkerThread));
+	if(exec == NULL)
+		return NULL;
+	for(i=0;i<nbstates;i++)
+	{
+		tWorkerThread* w = exec->Workers + i;
+		w->L = states[i];
+		w->Head = w->Tail = &w->Stub;
+		if(!SemInit(&w->Pending))
+			break;
+#ifdef _WIN32
+		w->Thread = CreateThread(NULL, 0, WorkerThread, w, 0, NULL);
+		if(w->Thread == NULL)
+#else
+		if(pthread_create(&w->Thread, NULL, WorkerThread, w))
+#endif
+		{
+			SemDestroy(&w->Pending);
+			break;
+		}
+		exec->NbWorkers++;
+	}
+	if(i < nbstates)
+	{
+		lua_genstop(exec);
+		return NULL;
+	}
+	return exec;
 }
 
-LUALIB_API void lua_gencallW(lua_State* L, const wchar_t* script, const wchar_t* format, ...)
+/* Copies the arguments into a job, in two passes: the first one measures the sizes */
+LUALIB_API lgencall_future* lua_gensubmitA(lgencall_executor* exec, lgencall_doneCB fct, void* ud,
+                                           const char* script, const char* format, ...)
 {
 	tEnvironment env;
+	tEscape escape;
+	tMarshal m;
 	tVaList marker;
+	tJob* job = NULL;
+	tWorkerThread* w;
+	lgencall_future* future = NULL;
+	size_t offset, scriptlen = script ? strlen(script) + 1 : 0;
+	int ok;
+	char* error;
+	if(fct == NULL)
+	{
+		future = (lgencall_future*)malloc(sizeof(lgencall_future));
+		if(future == NULL)
+			return NULL;
+		if(!SemInit(&future->Done))
+		{
+			free(future);
+			return NULL;
+		}
+		future->Error = NULL;
+	}
+	if(format == NULL)
+		format = "";
 	memset(&env, 0, sizeof(tEnvironment));
-	do
+	memset(&m, 0, sizeof(tMarshal));
+	env.Escape = &escape;
+	va_start(marker.List, format);
+	ok = MarshalArguments(&m, &env, format, &marker);
+	va_end(marker.List);
+	if(ok)
 	{
-		FillEnvironment(L, &env);
+		offset = AlignArgument(sizeof(tJob), 16);
+		m.ArgsSize = AlignArgument(m.ArgsSize, 16);
+		job = (tJob*)malloc(offset + m.ArgsSize + m.DataSize + scriptlen + strlen(format) + 1);
+		if(job == NULL)
+		{
+			strcpy(escape.Message, "not enough memory");
+			ok = 0;
+		}
+	}
+	if(ok)
+	{
+		memset(job, 0, sizeof(tJob));
+		job->Fct = fct;
+		job->Ud = ud;
+		job->Future = future;
+		job->CallerScript = script;
+		m.Args = (uint8_t*)job + offset;
+		m.Data = m.Args + m.ArgsSize;
+		job->Args = m.Args;
+		job->Format = (char*)m.Data + m.DataSize;
+		strcpy((char*)job->Format, format);
+		if(script)
+			job->Script = (char*)memcpy((char*)job->Format + strlen(format) + 1, script, scriptlen);
+		m.ArgsSize = m.DataSize = 0;
 		va_start(marker.List, format);
-		genericcallW(&env, script, format, &marker);
+		MarshalArguments(&m, &env, format, &marker);
 		va_end(marker.List);
+		w = exec->Workers + (unsigned long)ATOMIC_INCREMENT(&exec->NextWorker) % exec->NbWorkers;
+		PushJob(w, job);
+		SemPost(&w->Pending);
+		return future;
 	}
-	while(env.fNeedRestart);
-	GetErrorAndClose(&env, 0);
-}
-
-static int pgenericcallW(lua_State* L)
-{
-	tGenericCallParamsW* p = (tGenericCallParamsW*)lua_topointer(L, 1);
-	genericcallW(&p->Environment, p->Script, p->Format, &p->Marker);
-	return 0;
+	error = (char*)malloc(strlen(escape.Message) + 1);
+	if(error)
+		strcpy(error, escape.Message);
+	CompleteJob(fct, ud, future, error);
+	return future;
 }
 
-LUALIB_API wchar_t* lua_genpcallW(lua_State* L, const wchar_t* script, const wchar_t* format, ...)
+/* Waits for the completion of a call, and releases its future. Returns NULL on success,
+   else the error message, to be released with free. */
+LUALIB_API char* lua_genwait(lgencall_future* future)
 {
-	tGenericCallParamsW p;
-	int res;
-	memset(&p.Environment, 0, sizeof(tEnvironment));
-	do
-	{
-		FillEnvironment(L, &p.Environment);
-		va_start(p.Marker.List, format);
-		p.Script = script;
-		p.Format = format;
-		res = lua_cpcall(p.Environment.L, pgenericcallW, &p);
-		va_end(p.Marker.List);
-	}
-	while(p.Environment.fNeedRestart);
-	if(res)
-		LuaStringToWideString(p.Environment.L, -1);
-	return (wchar_t*)GetErrorAndClose(&p.Environment, res);
+	char* error;
+	SemWait(&future->Done);
+	error = future->Error;
+	SemDestroy(&future->Done);
+	free(future);
+	return error;
 }
 #endif
@@ -50,13 +50,140 @@
 #define LGENCALL_USE_LONG_DOUBLE 0
 #endif
 
+/* LGENCALL_USE_LUA_INTERNALS allows access to internal structures of Lua.
+   0 : only the public Lua API is used
+   1 : numerical output arrays are read directly from the array part of Lua tables.
+       The library must then be compiled with the sources of the Lua version it is linked to. */
+#ifndef LGENCALL_USE_LUA_INTERNALS
+#define LGENCALL_USE_LUA_INTERNALS 0
+#endif
+
+/* LGENCALL_USE_FORK enables the worker processes of lua_genfork and the %W directive.
+   0 : no support
+   1 : supported, on POSIX systems only (fork and socketpair) */
+#ifndef LGENCALL_USE_FORK
+#define LGENCALL_USE_FORK 0
+#endif
+
+/* LGENCALL_USE_BYTECODE_STORE enables a process wide store of compiled chunks, shared by all states.
+   0 : each state compiles its chunks
+   1 : the bytecode of a chunk compiled by a state is reloaded by the other states.
+       The store is protected by a Windows SRW lock or a POSIX mutex. */
+#ifndef LGENCALL_USE_BYTECODE_STORE
+#define LGENCALL_USE_BYTECODE_STORE 0
+#endif
+
+/* LGENCALL_USE_TRACE enables the tracer of the %T directive, which records the phases of each call.
+   0 : no support
+   1 : events are recorded in a ring buffer per thread, and dumped in Chrome trace-event format.
+       The compiler must support thread local variables. */
+#ifndef LGENCALL_USE_TRACE
+#define LGENCALL_USE_TRACE 0
+#endif
+
+/* LGENCALL_USE_THREADS enables the executor of lua_genstart, whose worker threads each own a state.
+   0 : no support
+   1 : calls are submitted through a lock-free queue per thread, with Windows threads or POSIX
+       threads and semaphores. The compiler must provide atomic builtins (MSVC, GCC or Clang). */
+#ifndef LGENCALL_USE_THREADS
+#define LGENCALL_USE_THREADS 0
+#endif
+
+/* LGENCALL_WIDTH_TYPE is the C type of the width arguments passed with '*' (by value)
+   and '&' (by pointer). Define it as size_t to pass arrays of more than INT_MAX elements. */
+#ifndef LGENCALL_WIDTH_TYPE
+#define LGENCALL_WIDTH_TYPE int
+#endif
+
 
 typedef void (*lgencall_pushCB)(lua_State* L, const void* ptr);
 typedef void (*lgencall_getCB)(lua_State* L, int idx, void* ptr);
+typedef int (*lgencall_emitCB)(lua_State* L, void* ud);
+typedef size_t (*lgencall_rowsCB)(void* ud, void* rows, size_t maxrows);
+
+/* Library masks of the %*O directive. Libraries not in the mask are registered
+   in package.preload when the package library is opened, to be loaded by require. */
+#define LGENCALL_LIB_BASE     0x01
+#define LGENCALL_LIB_PACKAGE  0x02
+#define LGENCALL_LIB_TABLE    0x04
+#define LGENCALL_LIB_IO       0x08
+#define LGENCALL_LIB_OS       0x10
+#define LGENCALL_LIB_STRING   0x20
+#define LGENCALL_LIB_MATH     0x40
+#define LGENCALL_LIB_DEBUG    0x80
+#define LGENCALL_LIB_ALL      0xFF
+
+/* Statistics of the garbage collector filled by the %&G directive */
+typedef struct
+{
+	size_t memory;       /* memory in use after the call, in KB */
+	unsigned long time;  /* time spent in collection steps after the call, in microseconds */
+	int cycles;          /* number of collection cycles completed by these steps */
+} lgencall_gcstats;
+
+/* Statistics of the result cache filled by the %&H directive */
+typedef struct
+{
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;  /* entries removed because the cache was full or expired */
+	size_t entries;
+} lgencall_memostats;
+
+/* Statistics of the bytecode store filled by the %&F directive, counted since the
+   start of the process, all zero when LGENCALL_USE_BYTECODE_STORE is 0 */
+typedef struct
+{
+	unsigned long hits;    /* chunks loaded from the store instead of being compiled */
+	unsigned long misses;  /* chunks compiled because they were not in the store */
+	size_t chunks;         /* chunks in the store */
+	size_t bytes;          /* size of their bytecode */
+} lgencall_storestats;
+
+/* Error codes of lgencall_error */
+#define LGENCALL_OK           0
+#define LGENCALL_ERRFORMAT    1  /* invalid format string */
+#define LGENCALL_ERRSCRIPT    2  /* script compilation error, or function not found */
+#define LGENCALL_ERRARGUMENT  3  /* conversion error of an input or output argument */
+#define LGENCALL_ERRRUN       4  /* runtime error of the script */
+#define LGENCALL_ERRMEM       5  /* memory allocation error */
+#define LGENCALL_ERRBUDGET    6  /* instruction or time budget of %B exceeded */
+
+/* Error report filled by the %X directive. The caller may supply a message buffer,
+   of size characters (wchar_t for lua_genpcallW), which is then returned on error. */
+typedef struct
+{
+	int code;
+	int argument;        /* argument number of an argument error, or 0 */
+	int direction;       /* 0 for an input argument, 1 for an output argument */
+	const void* script;  /* script of the failed call */
+	void* message;
+	size_t size;
+} lgencall_error;
 
 LUALIB_API void (lua_gencallA)(lua_State* L, const char* script, const char* format, ...);
 LUALIB_API char* (lua_genpcallA)(lua_State* L, const char* script, const char* format, ...);
 
+#if LGENCALL_USE_FORK
+#include <sys/types.h>
+LUALIB_API int (lua_genfork)(lua_State* L, int nbworkers, int* fds, pid_t* pids);
+#endif
+
+#if LGENCALL_USE_THREADS
+/* Executor of lua_genstart, and pending call of lua_gensubmitA */
+typedef struct lgencall_executor lgencall_executor;
+typedef struct lgencall_future lgencall_future;
+/* Completion callback of lua_gensubmitA, run by the worker thread. The error message
+   is NULL on success, else it must be released with free. */
+typedef void (*lgencall_doneCB)(void* ud, char* error);
+
+LUALIB_API lgencall_executor* (lua_genstart)(lua_State** states, int nbstates);
+LUALIB_API void (lua_genstop)(lgencall_executor* exec);
+LUALIB_API lgencall_future* (lua_gensubmitA)(lgencall_executor* exec, lgencall_doneCB fct, void* ud,
+                                             const char* script, const char* format, ...);
+LUALIB_API char* (lua_genwait)(lgencall_future* future);
+#endif
+
 #if LGENCALL_USE_WIDESTRING
 LUALIB_API void (lua_gencallW)(lua_State* L, const wchar_t* script, const wchar_t* format, ...);
 LUALIB_API wchar_t* (lua_genpcallW)(lua_State* L, const wchar_t* script, const wchar_t* format, ...);
@@ -1,20 +1,76 @@
 /* Test functions for lgencall.c.
    Uses the same functions as the documentation examples,
-   with the difference that it supports Unicode and ANSI compilation.
+   with the difference that it supports Unicode and ANSI compilation,
+   and that results are checked instead of printed.
    The header file <tchar.h>, found only on Windows systems, consists of
-   macro definitions like _T(string), to support both compilation modes. */
-   
+   macro definitions like _T(string), to support both compilation modes.
+   On other systems, the few definitions needed are provided below.
+   The program prints failed checks and returns a non zero exit code.
+   Example of a Linux build with sanitizers, Lua 5.1 sources in lua/src:
+     g++ -g -fsanitize=address,undefined -Ilua/src -x c lgencall.c -x c++ testwin.cpp lua/src/liblua.a -lm -ldl
+   Add -D_UNICODE to test the wide character functions. */
+
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
-#include <tchar.h>
+#include <wchar.h>
 #include <stdio.h>
+#ifdef _WIN32
+#include <tchar.h>
+#else
+#ifdef _UNICODE
+#define __T(x)      L ## x
+#define _tcscmp     wcscmp
+#define _tcsstr     wcsstr
+typedef wchar_t TCHAR;
+#else
+#define __T(x)      x
+#define _tcscmp     strcmp
+#define _tcsstr     strstr
+typedef char TCHAR;
+#endif
+#define _T(x)       __T(x)
+#endif
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
 extern "C" {
 #include "lua.h"
 #include "lauxlib.h"
 #include "lualib.h"
 #include "lgencall.h"
 }
+#if LGENCALL_USE_FORK
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#endif
+
+static int nb_errors = 0;
+
+#define CHECK(cond)      check((cond) != 0, #cond, __LINE__)
+#define CHECK_CALL(call) check_call((call), __LINE__)
+
+static void check(bool ok, const char* cond, int line)
+{
+	if(ok)
+		return;
+	printf("line %d: check failed: %s\n", line, cond);
+	nb_errors++;
+}
+static void check_call(const char* errmsg, int line)
+{
+	if(errmsg == NULL)
+		return;
+	printf("line %d: unexpected error: %s\n", line, errmsg);
+	nb_errors++;
+}
+#if LGENCALL_USE_WIDESTRING
+static void check_call(const wchar_t* errmsg, int line)
+{
+	if(errmsg == NULL)
+		return;
+	printf("line %d: unexpected error: %ls\n", line, errmsg);
+	nb_errors++;
+}
+#endif
 
 static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
   (void)ud;
@@ -29,19 +85,21 @@ static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
 
 static void test_in_numbers(lua_State* L)
 {
-	lua_genpcall(L, _T("for k,v in pairs{...} do print(k, type(v), v) end"), 
-		_T("%i%d%u%f%f"), -4, 0xFFFFFFFF, 0xFFFFFFFF, 3.1415926535f, 3.1415926535);
+	CHECK_CALL(lua_genpcall(L, _T("local a,b,c,d,e = ...; assert(a == -4 and b == -1 and c == 4294967295);")
+		_T("assert(math.abs(d - 3.1415926535) < 1e-6 and e == 3.1415926535)"),
+		_T("%i%d%u%f%f"), -4, 0xFFFFFFFF, 0xFFFFFFFF, 3.1415926535f, 3.1415926535));
 }
 
 static void test_in_other_scalars(lua_State* L)
 {
-	lua_genpcall(L, _T("for k,v in pairs{...} do print(k, type(v), v) end"), 
-		_T("%b%b%n%s%t%p"), 0, 1, _T("Hello"), L, L);
+	CHECK_CALL(lua_genpcall(L, _T("local a,b,c,d,e,f = ...; assert(a == false and b == true and c == nil);")
+		_T("assert(d == 'Hello' and type(e) == 'thread' and type(f) == 'userdata')"),
+		_T("%b%b%n%s%t%p"), 0, 1, _T("Hello"), L, L));
 }
 
 static int cFunction(lua_State* L)
 {
-	printf("%s\n", luaL_checkstring(L, 1));
+	luaL_checkstring(L, 1);
 	return 1;
 }
 static void pushMessage(lua_State* L, const void* ptr)
@@ -50,52 +108,145 @@ static void pushMessage(lua_State* L, const void* ptr)
 }
 static void test_in_function_callback(lua_State* L)
 {
-	lua_genpcall(L, _T("local fct, msg = ...; fct(msg)"), 
-		_T("%c%k"), cFunction, pushMessage, 2);
+	CHECK_CALL(lua_genpcall(L, _T("local fct, msg = ...; assert(msg == 2 and fct(msg) == '2')"),
+		_T("%c%k"), cFunction, pushMessage, 2));
 }
 
 static void test_in_arrays(lua_State* L)
 {
 	short array[] = { 1,2,3 };
-	lua_genpcall(L, 
-		_T("for k,v in pairs{...} do print(k, #v, table.concat(v, ', ')) end"), 
-		_T("%2hd%5.1u%*.*d"), array, "Hello", 
-		sizeof(array)/sizeof(array[0]), sizeof(array[0]), array);
+	CHECK_CALL(lua_genpcall(L,
+		_T("local a,b,c = ...; assert(table.concat(a, ',') == '1,2');")
+		_T("assert(table.concat(b, ',') == '72,101,108,108,111' and table.concat(c, ',') == '1,2,3')"),
+		_T("%2hd%5.1u%*.*d"), array, "Hello",
+		(int)(sizeof(array)/sizeof(array[0])), (int)sizeof(array[0]), array));
+}
+
+typedef struct
+{
+	double x, y;
+} tPoint;
+static void test_in_float_arrays(lua_State* L)
+{
+	float farray[3] = { 0.5f, 1.5f, 2.5f };
+	double darray[3] = { 3.25, 4.25, 5.25 };
+	float fout[4] = { 0, 0, 0, -1 };
+	double dout[4] = { 0, 0, 0, -1 };
+	float f = 0;
+	double d = 0;
+	int top = lua_gettop(L);
+	CHECK_CALL(lua_genpcall(L,
+		_T("local fa, da, f, d = ...; assert(select('#', ...) == 4 and #fa == 3 and #da == 3);")
+		_T("assert(fa[1] == 0.5 and fa[3] == 2.5 and da[1] == 3.25 and da[3] == 5.25 and f == 6.5 and d == 7.75);")
+		_T("return fa, da, f, d"),
+		_T("%3f %3lf %f %lf>%4f %4lf %f %lf"), farray, darray, 6.5f, 7.75, fout, dout, &f, &d));
+	CHECK(fout[0] == 0.5f && fout[2] == 2.5f && fout[3] == -1);
+	CHECK(dout[0] == 3.25 && dout[2] == 5.25 && dout[3] == -1);
+	CHECK(f == 6.5f && d == 7.75);
+	CHECK(lua_gettop(L) == top);
+}
+
+static void test_in_shaped_arrays(lua_State* L)
+{
+	int matrix[2][3] = { {1,2,3}, {4,5,6} };
+	tPoint points[3] = { {1,10}, {2,20}, {3,30} };
+	CHECK_CALL(lua_genpcall(L,
+		_T("local m, c, y = ...; assert(#m == 2 and table.concat(m[1], ',') == '1,2,3' and table.concat(m[2], ',') == '4,5,6');")
+		_T("assert(table.concat(c, ',') == '2,5' and table.concat(y, ',') == '10,20,30')"),
+		_T("%2,3d %2:12d %3:*lf"), matrix, &matrix[0][1], (int)sizeof(tPoint), &points[0].y));
+}
+
+static void test_in_reused_tables(lua_State* L)
+{
+	int array[] = { 4,5,6,7 };
+	int i;
+	for(i=4;i>0;i--)
+		CHECK_CALL(lua_genpcall(L,
+			_T("local t, l, n = ...; assert(#t == n and t[n] == n + 3 and #l == n and l[n] == 's'..n)"),
+			_T("%+*d %+*hz %d"), i, array, i*3, "s1\0s2\0s3\0s4\0", i));
 }
 
 static void test_in_strings(lua_State* L)
 {
 	unsigned char data[] = { 200, 100, 0, 3, 5, 0 };
-	lua_genpcall(L, _T("for k,v in pairs{...} do print(k, v:gsub('.', ")
-		_T("function(c) return '\\\\'..c:byte() end)) end"), 
-		_T("%hs%6s%*.1s%ls"), "Hello", _T("P1\0P2"), sizeof(data), data, L"t");
+	CHECK_CALL(lua_genpcall(L, _T("local a,b,c,d = ...; assert(a == 'Hello' and b == 'P1\\0P2\\0');")
+		_T("assert(c == '\\200\\100\\0\\3\\5\\0')"),
+		_T("%hs%6s%*.1s"), "Hello", _T("P1\0P2"), (int)sizeof(data), data));
+#if LGENCALL_USE_WIDESTRING
+	CHECK_CALL(lua_genpcall(L, _T("assert(... == 'Unicode')"), _T("%ls"), L"Unicode"));
+#endif
+#if LGENCALL_USE_WIDESTRING == 2
+	CHECK_CALL(lua_genpcall(L, _T("assert(... == '\\195\\169t\\195\\169')"),
+		_T("%ls"), L"\u00e9t\u00e9"));
+#endif
 }
 
 static void test_in_string_lists(lua_State* L)
 {
-	lua_genpcall(L, 
-		_T("for k,v in pairs{...} do print(k, #v, table.concat(v, ',')) end"),
-		_T("%z  %7z %hz %*lz"), _T("s1\0s2\0s3\0"), _T("s4\0\0s5\0"), 
-		"c1\0c2\0c3\0", 7, L"w1\0\0w2\0"
-	);
+	CHECK_CALL(lua_genpcall(L,
+		_T("local a,b,c = ...; assert(table.concat(a, ',') == 's1,s2,s3' and table.concat(b, ',') == 's4,,s5');")
+		_T("assert(table.concat(c, ',') == 'c1,c2,c3')"),
+		_T("%z  %7z %hz"), _T("s1\0s2\0s3\0"), _T("s4\0\0s5\0"), "c1\0c2\0c3\0"));
+#if LGENCALL_USE_WIDESTRING
+	CHECK_CALL(lua_genpcall(L, _T("assert(table.concat(..., ',') == 'w1,,w2')"),
+		_T("%*lz"), 7, L"w1\0\0w2\0"));
+#endif
+}
+
+typedef struct
+{
+	int id;
+	double value;
+	const char* name;
+} tRow;
+static size_t fetchRows(void* ud, void* rows, size_t maxrows)
+{
+	static const tRow data[] = { {1, 1.5, "one"}, {2, 2.5, "two"}, {3, 3.5, "three"} };
+	size_t* pos = (size_t*)ud;
+	size_t nb = MIN(maxrows, sizeof(data)/sizeof(data[0]) - *pos);
+	memcpy(rows, data + *pos, nb * sizeof(tRow));
+	*pos += nb;
+	return nb;
+}
+static void test_in_rows(lua_State* L)
+{
+	size_t pos = 0;
+	double total = 0;
+	const char* names = NULL;
+	int ended = 0;
+	CHECK_CALL(lua_genpcall(L, _T("local s, t = 0, {}; for id, value, name in ... do s = s + id * value; t[#t+1] = name end;")
+		_T("return s, table.concat(t, ',')"),
+		_T("%2y>%lf%+hs"), "%d %lf %hs", fetchRows, &pos, &total, &names));
+	CHECK(total == 1.5 + 5.0 + 10.5);
+	CHECK(names != NULL && strcmp(names, "one,two,three") == 0);
+	/* An iterator kept by the script ends with the call, even a failed one */
+	pos = 0;
+	CHECK_CALL(lua_genpcall(L, _T("kept_rows = ... kept_rows()"), _T("%1y"), "%d %lf %hs", fetchRows, &pos));
+	CHECK_CALL(lua_genpcall(L, _T("return kept_rows() == nil"), _T(">%b"), &ended));
+	CHECK(ended && pos == 1);
+	ended = 0;
+	CHECK(lua_genpcall(L, _T("kept_rows = ... kept_rows() error('rows')"), _T("%1y"), "%d %lf %hs", fetchRows, &pos) != NULL);
+	CHECK_CALL(lua_genpcall(L, _T("local id = kept_rows() kept_rows = nil return id == nil"), _T(">%b"), &ended));
+	CHECK(ended && pos == 2);
 }
 
 static void test_out_numbers(lua_State* L)
 {
 	char var1; unsigned short var2; int var3;
 	float var4; double var5;
-	lua_genpcall(L, _T("return 1, 2, 3, 4, 5"), _T(">%hhd%hu%d%f%lf"), 
-		&var1, &var2, &var3, &var4, &var5);
-	printf("%d %u %d %f %f\n", var1, var2, var3, var4, var5);
+	CHECK_CALL(lua_genpcall(L, _T("return 1, 2, 3, 4, 5"), _T(">%hhd%hu%d%f%lf"),
+		&var1, &var2, &var3, &var4, &var5));
+	CHECK(var1 == 1 && var2 == 2 && var3 == 3 && var4 == 4.0f && var5 == 5.0);
 }
 
 static void test_out_other_scalars(lua_State* L)
 {
-	bool bool1; int bool2; 
+	bool bool1; int bool2;
 	const char* str; void* ptr;
-	lua_genpcall(L, _T("return true, false, 'dummy', 'Hello', io.stdin"), 
-		_T(">%b%b%n%+hs%p"), &bool1, &bool2, &str, &ptr);
-	printf("%hd %ld %s %p\n", bool1, bool2, str, ptr);
+	CHECK_CALL(lua_genpcall(L, _T("return true, false, 'dummy', 'Hello', io.stdin"),
+		_T(">%b%lb%n%+hs%p"), &bool1, &bool2, &str, &ptr));
+	CHECK(bool1 && bool2 == 0);
+	CHECK(strcmp(str, "Hello") == 0 && ptr != NULL);
 }
 
 static void getMessage(lua_State* L, int idx, void* ptr)
@@ -106,29 +257,63 @@ static void test_out_function_callback(lua_State* L)
 {
 	lua_CFunction fct;
 	const char* msg;
-	lua_genpcall(L, _T("return print, 'Hello World!'"), 
-		_T(">%c%k"), &fct, getMessage, &msg);
-	lua_pushstring(L, msg);
-	fct(L);
+	CHECK_CALL(lua_genpcall(L, _T("return tostring, 'Hello World!'"),
+		_T(">%c%k"), &fct, getMessage, &msg));
+	CHECK(strcmp(msg, "Hello World!") == 0);
+	lua_settop(L, 0);
+	lua_pushnumber(L, 12);
+	CHECK(fct(L) == 1 && strcmp(lua_tostring(L, -1), "12") == 0);
+	lua_settop(L, 0);
 }
 
 static void test_out_arrays(lua_State* L)
 {
 	unsigned int int_a[3];
-	bool bool_a[4];
-	char* str; 
+	bool bool_a[4] = { true, false, true, true };
+	char* str;
 	short* pshort;
 	int short_len;
 	int bool_len = sizeof(bool_a)/sizeof(bool_a[0]);
-	lua_genpcall(L, _T("return {1,2,3,4},{72,101,108,108,111,0}, {5,6,7}, {false,true}"), 
-		_T(">%3u%+.1d%#&hd%&.*b"), &int_a, &str, &short_len, &pshort, 
-		&bool_len, sizeof(bool_a[0]), &bool_a);
-	printf("int_a = {%u,%u,%u}\nstr = %s\npshort[%d]=%d\nbool_a = #%d:{%d,%d,%d,%d}\n", 
-		int_a[0], int_a[1], int_a[2], str, short_len-1, pshort[short_len-1],
-		bool_len, bool_a[0], bool_a[1], bool_a[2], bool_a[3]);
+	CHECK_CALL(lua_genpcall(L, _T("return {1,2,3,4},{72,101,108,108,111,0}, {5,6,7}, {false,true}"),
+		_T(">%3u%+.1d%#&hd%&.*b"), &int_a, &str, &short_len, &pshort,
+		&bool_len, (int)sizeof(bool_a[0]), &bool_a));
+	CHECK(int_a[0] == 1 && int_a[1] == 2 && int_a[2] == 3);
+	CHECK(strcmp(str, "Hello") == 0);
+	CHECK(short_len == 3 && pshort[0] == 5 && pshort[1] == 6 && pshort[2] == 7);
+	CHECK(bool_len == 2 && !bool_a[0] && bool_a[1] && bool_a[2] && bool_a[3]);
 	free(pshort);
 }
 
+static void test_out_large_arrays(lua_State* L)
+{
+	double* values = NULL;
+	int len = 0, i, nberrors = 0;
+	float part[4];
+	CHECK_CALL(lua_genpcall(L, _T("local t = {}; for i=1,100000 do t[i] = i / 2 end; return t"),
+		_T(">%#&lf"), &len, &values));
+	CHECK(len == 100000);
+	for(i=0;i<len;i++)
+		nberrors += values[i] != (i + 1) / 2.0;
+	CHECK(nberrors == 0);
+	free(values);
+	CHECK_CALL(lua_genpcall(L, _T("return {1.5, 2.5, [3] = 3.5, [4] = 4.5}"), _T(">%4f"), part));
+	CHECK(part[0] == 1.5f && part[1] == 2.5f && part[2] == 3.5f && part[3] == 4.5f);
+	CHECK(lua_genpcall(L, _T("return {1, 2, 'x'}"), _T(">%3f"), part) != NULL);
+}
+
+static void test_out_shaped_arrays(lua_State* L)
+{
+	int matrix[2][3] = { {0,0,0}, {0,0,0} };
+	int tile[2][3] = { {0,0,0}, {0,0,0} };
+	tPoint points[3] = { {1,0}, {2,0}, {3,0} };
+	CHECK_CALL(lua_genpcall(L, _T("return {{1,2,3},{4,5,6,7}}, {7,8,9,10}, {10,20,30}"),
+		_T(">%2,3d %2:12,2d %3:*lf"), matrix, tile, (int)sizeof(tPoint), &points[0].y));
+	CHECK(matrix[0][0] == 1 && matrix[0][2] == 3 && matrix[1][0] == 4 && matrix[1][2] == 6);
+	CHECK(tile[0][0] == 7 && tile[0][1] == 8 && tile[0][2] == 0 && tile[1][0] == 9 && tile[1][1] == 10 && tile[1][2] == 0);
+	CHECK(points[0].x == 1 && points[0].y == 10 && points[2].x == 3 && points[2].y == 30);
+	CHECK(lua_genpcall(L, _T("return {}"), _T(">%#2,3d"), (void*)NULL) != NULL);
+}
+
 static void test_out_strings(lua_State* L)
 {
 	const TCHAR *str1;
@@ -136,67 +321,435 @@ static void test_out_strings(lua_State* L)
 	TCHAR str3[10];
 	unsigned char data[6];
 	int len = sizeof(data);
-	wchar_t* wstr;
-	lua_genpcall(L, _T("return 'Hello', ' Wor', 'ld!', '\\0\\5\\200\\0', 'Unicode'"),
-		_T(">%+s%#s%*s%&hs%+ls"), &str1, &str2, sizeof(str3), str3, &len, data, &wstr);
-	_tprintf(_T("%s%s%s\ndata (%d bytes): %02X %02X %02X %02X %02X\n"), 
-		str1, str2, str3, len, data[0],data[1],data[2],data[3],data[4]);
-	printf("wstr = %S\n", wstr);
+	CHECK_CALL(lua_genpcall(L, _T("return 'Hello', ' Wor', 'ld!', '\\0\\5\\200\\0'"),
+		_T(">%+s%#s%*s%&hs"), &str1, &str2, (int)(sizeof(str3)/sizeof(str3[0])), str3, &len, data));
+	CHECK(_tcscmp(str1, _T("Hello")) == 0 && _tcscmp(str2, _T(" Wor")) == 0 && _tcscmp(str3, _T("ld!")) == 0);
+	CHECK(len == 4 && memcmp(data, "\0\5\310\0\0", 5) == 0);	/* octal 310 is Lua's decimal \200 */
 	free(str2);
+#if LGENCALL_USE_WIDESTRING
+	wchar_t* wstr;
+	CHECK_CALL(lua_genpcall(L, _T("return 'Unicode'"), _T(">%+ls"), &wstr));
+	CHECK(wcscmp(wstr, L"Unicode") == 0);
+#endif
 }
 
-static void print_string_list(const char* title, const void* data, int fchar)
+static void join_string_list(const char* data, char* buffer)
 {
-	printf("%-4s = {", title);
-	if(fchar)
+	*buffer = 0;
+	while(*data)
 	{
-		const char* str = (const char*)data;
-		while(*str)
-		{
-			printf("'%s', ", str);
-			str += strlen(str) + 1;
-		}
+		strcat(buffer, data);
+		strcat(buffer, ",");
+		data += strlen(data) + 1;
 	}
-	else
+}
+#if LGENCALL_USE_WIDESTRING
+static void join_string_list(const wchar_t* data, char* buffer)
+{
+	while(*data)
 	{
-		const wchar_t* str = (const wchar_t*)data;
-		while(*str)
-		{
-			printf("'%S', ", str);
-			str += wcslen(str) + 1;
-		}
+		while(*data)
+			*buffer++ = (char)*data++;
+		*buffer++ = ',';
+		data++;
 	}
-	printf("}\n");
+	*buffer = 0;
 }
+#endif
 static void test_out_string_lists(lua_State* L)
 {
 	const char *str1;
 	TCHAR *str2;
 	TCHAR str3[10];
 	int len;
+	char buffer[32];
+	CHECK_CALL(lua_genpcall(L, _T("return {1,2,3},{4,5,6},{10,9,8,7}"),
+		_T(">%+hz %+&z %*z"), &str1, &len, &str2,
+		(int)(sizeof(str3)/sizeof(str3[0])), &str3));
+	join_string_list(str1, buffer);
+	CHECK(strcmp(buffer, "1,2,3,") == 0);
+	join_string_list(str2, buffer);
+	CHECK(strcmp(buffer, "4,5,6,") == 0 && len == 6);
+	join_string_list(str3, buffer);
+	CHECK(strcmp(buffer, "10,9,8,7,") == 0);
+#if LGENCALL_USE_WIDESTRING
 	wchar_t* wstr;
-	lua_genpcall(L, _T("return {1,2,3},{4,5,6},{10,9,8,7},{11,12}"),
-		_T(">%+hz %+&z %*z %#lz"), &str1, &len, &str2, 
-		sizeof(str3)/sizeof(str3[0]), &str3, &wstr );
-	print_string_list("str1", str1, 1);
-	print_string_list("str2", str2, sizeof(TCHAR)==1);
-	printf("len = %d\n", len);
-	print_string_list("str3", str3, sizeof(TCHAR)==1);
-	print_string_list("wstr", wstr, 0);
+	CHECK_CALL(lua_genpcall(L, _T("return {11,12}"), _T(">%#lz"), &wstr));
+	join_string_list(wstr, buffer);
+	CHECK(strcmp(buffer, "11,12,") == 0);
 	free(wstr);
+#endif
 }
 
 static void test_null_parameters(lua_State* L)
 {
 	lua_gencallA(NULL, NULL, NULL);
-	lua_genpcallA(NULL, NULL, NULL);
+	CHECK_CALL(lua_genpcallA(NULL, NULL, NULL));
+#if LGENCALL_USE_WIDESTRING
 	lua_gencallW(NULL, NULL, NULL);
-	lua_genpcallW(NULL, NULL, NULL);
+	CHECK_CALL(lua_genpcallW(NULL, NULL, NULL));
+#endif
+}
+
+static void test_directives(lua_State* L)
+{
+	lua_State* L2 = NULL;
+	lua_Alloc falloc = NULL;
+	int res = 0;
+	CHECK_CALL(lua_genpcall(NULL, _T("assert(string)"), _T("%M %O %S %&M<"), l_alloc, &L2, &falloc));
+	CHECK(L2 != NULL && falloc == l_alloc);
+	CHECK_CALL(lua_genpcall(L2, _T("return 1 + 1"), _T("%F %G<>%d"), &res));
+	CHECK(res == 2);
+	/* With a bytecode store, the chunk is now loaded from it by other states */
+	CHECK_CALL(lua_genpcall(NULL, _T("return 1 + 1"), _T(">%d"), &res));
+	CHECK(res == 2);
+	CHECK_CALL(lua_genpcall(L2, _T("return 1 + 1"), _T("%#F<>%d"), &res));
+	CHECK(res == 2);
+	CHECK_CALL(lua_genpcall(L2, _T("return"), _T("%C<")));
+	CHECK_CALL(lua_genpcall(NULL, _T("assert(string and math and not io and not os and package.preload.io)"),
+		_T("%*O<"), LGENCALL_LIB_BASE | LGENCALL_LIB_PACKAGE | LGENCALL_LIB_STRING | LGENCALL_LIB_MATH));
+	CHECK_CALL(lua_genpcall(NULL, _T("assert(require 'table' == table and table.concat)"),
+		_T("%*O<"), LGENCALL_LIB_BASE | LGENCALL_LIB_PACKAGE));
+}
+
+#if LGENCALL_USE_BYTECODE_STORE
+static void test_bytecode_store(lua_State* L)
+{
+	lgencall_storestats before, after;
+	int res = 0;
+	CHECK_CALL(lua_genpcall(L, NULL, _T("%&F<"), &before));
+	/* The first state compiles the chunk, the second one loads it from the store */
+	CHECK_CALL(lua_genpcall(NULL, _T("return 40 + 2"), _T(">%d"), &res));
+	CHECK(res == 42);
+	CHECK_CALL(lua_genpcall(NULL, _T("return 40 + 2"), _T("%&F<>%d"), &after, &res));
+	CHECK(res == 42 && after.misses == before.misses + 1 && after.chunks == before.chunks + 1 && after.bytes > before.bytes);
+	CHECK_CALL(lua_genpcall(L, NULL, _T("%&F<"), &after));
+	CHECK(after.hits == before.hits + 1 && after.misses == before.misses + 1);
+	CHECK_CALL(lua_genpcall(L, NULL, _T("%#F %&F<"), &after));
+	CHECK(after.chunks == 0 && after.bytes == 0);
+}
+#endif
+
+static void test_garbage_collection(lua_State* L)
+{
+	lgencall_gcstats stats;
+	int res = 0;
+	memset(&stats, 0, sizeof(stats));
+	CHECK_CALL(lua_genpcall(L, _T("local t = {} for i=1,1000 do t[i] = {} end return #t"), 
+		_T("%+*G %&G<>%d"), 16, &stats, &res));
+	CHECK(res == 1000 && stats.memory > 0);
+	CHECK_CALL(lua_genpcall(L, NULL, _T("%*.*G %&G<"), 0, 100000, &stats));
+	CHECK(stats.cycles == 1);
+	/* The steps also run after a failed call */
+	memset(&stats, 0, sizeof(stats));
+	CHECK(lua_genpcall(L, _T("local t = {} for i=1,1000 do t[i] = {} end error('gc')"),
+		_T("%*.*G %&G<"), 0, 100000, &stats) != NULL);
+	CHECK(stats.cycles == 1 && stats.memory > 0);
+	lua_gc(L, LUA_GCRESTART, 0);
+}
+
+static void test_profiler(lua_State* L)
+{
+	const TCHAR* busy = _T("local function busy() local x = 0 for i=1,2000000 do x = x + i end return x end busy()");
+	char* stacks = NULL;
+	/* The samples are exported after the call, with the samples of this call */
+	CHECK_CALL(lua_genpcall(L, busy, _T("%*P %&P<"), 200, &stacks));
+	CHECK(stacks != NULL && strstr(stacks, "busy@") != NULL && strchr(stacks, ';') != NULL);
+	free(stacks);
+	/* They are kept per script, and a call without script exports them all */
+	CHECK_CALL(lua_genpcall(L, busy, _T("%*P<"), 200));
+	CHECK_CALL(lua_genpcall(L, _T("return"), _T("%&P<"), &stacks));
+	CHECK(stacks == NULL);
+	CHECK_CALL(lua_genpcall(L, NULL, _T("%&P<"), &stacks));
+	CHECK(stacks != NULL && strstr(stacks, "busy@") != NULL);
+	free(stacks);
+	CHECK_CALL(lua_genpcall(L, NULL, _T("%&P<"), &stacks));
+	CHECK(stacks == NULL);
+	/* The samples do not count in the budget of the call */
+	CHECK_CALL(lua_genpcall(L, busy, _T("%*P %*B %&P<"), 200, 10000000, &stacks));
+	CHECK(stacks != NULL && strstr(stacks, "busy@") != NULL);
+	free(stacks);
+}
+
+#if LGENCALL_USE_TRACE
+static int count_substrings(const char* str, const char* sub)
+{
+	int count = 0;
+	while((str = strstr(str, sub)) != NULL)
+	{
+		count++;
+		str += strlen(sub);
+	}
+	return count;
+}
+
+static void test_tracer(lua_State* L)
+{
+	char* json = NULL;
+	int res = 0;
+	CHECK_CALL(lua_genpcall(L, NULL, _T("%T<")));
+	CHECK_CALL(lua_genpcall(L, _T("return ... + 1"), _T("%d>%d"), 1, &res));
+	CHECK_CALL(lua_genpcall(L, NULL, _T("%*T %&T<"), 0, &json));
+	CHECK(json != NULL && strstr(json, "\"name\":\"call\",\"ph\":\"E\"") != NULL);
+	free(json);
+	/* The phases of a failed call are ended too, only the format of the dump is open */
+	CHECK_CALL(lua_genpcall(L, NULL, _T("%T<")));
+	CHECK(lua_genpcall(L, _T("error('boom')"), _T("")) != NULL);
+	CHECK_CALL(lua_genpcall(L, NULL, _T("%*T %&T<"), 0, &json));
+	CHECK(json != NULL && strstr(json, "\"name\":\"call\",\"ph\":\"E\"") != NULL);
+	CHECK(json != NULL && count_substrings(json, "\"ph\":\"B\"") == count_substrings(json, "\"ph\":\"E\"") + 1);
+	free(json);
+}
+#endif
+
+static void test_memoization(lua_State* L)
+{
+	lgencall_memostats stats;
+	int i, res = 0;
+	char str[16];
+	double values[3] = { 1, 2, 3 }, sum = 0, out[5];
+	lua_pushnumber(L, 0);
+	lua_setglobal(L, "nbcalls");
+	for(i=0;i<3;i++)
+	{
+		CHECK_CALL(lua_genpcall(L, _T("nbcalls = nbcalls + 1 local a, b = ... return a + b, 'ok'"),
+			_T("%*H %&H<%d%d>%d%16hs"), 2, &stats, 20, 22, &res, str));
+		CHECK(res == 42 && strcmp(str, "ok") == 0);
+	}
+	CHECK(stats.hits == 2 && stats.misses == 1 && stats.entries == 1);
+	CHECK_CALL(lua_genpcall(L, _T("local t = ... nbcalls = nbcalls + 1 return t[1] + t[2] + t[3]"),
+		_T("%*H %&H<%3lf>%lf"), 2, &stats, values, &sum));
+	CHECK(sum == 6 && stats.misses == 2);
+	values[2] = 4;
+	CHECK_CALL(lua_genpcall(L, _T("local t = ... nbcalls = nbcalls + 1 return t[1] + t[2] + t[3]"),
+		_T("%*H %&H<%3lf>%lf"), 2, &stats, values, &sum));
+	CHECK(sum == 7 && stats.misses == 3 && stats.evictions == 1 && stats.entries == 2);
+	CHECK_CALL(lua_genpcall(L, _T("assert(nbcalls == 3)"), _T("")));
+	CHECK(lua_genpcall(L, _T("return ..."), _T("%H<%p>%p"), L, &res) != NULL);
+	/* The output widths are part of the key: a wider output is not filled from a narrower result */
+	memset(out, 0, sizeof(out));
+	CHECK_CALL(lua_genpcall(L, _T("local n = ... return { n, 2*n, 3*n, 4*n, 5*n }"),
+		_T("%*H %&H<%d>%*lf"), 2, &stats, 1, (LGENCALL_WIDTH_TYPE)3, out));
+	CHECK(out[2] == 3 && out[3] == 0 && stats.misses == 4);
+	for(i=0;i<2;i++)
+	{
+		CHECK_CALL(lua_genpcall(L, _T("local n = ... return { n, 2*n, 3*n, 4*n, 5*n }"),
+			_T("%*H %&H<%d>%*lf"), 2, &stats, 1, (LGENCALL_WIDTH_TYPE)5, out));
+		CHECK(out[3] == 4 && out[4] == 5);
+	}
+	CHECK(stats.misses == 5 && stats.hits == 3);
+}
+
+static void test_function_reference(lua_State* L)
+{
+	int ref;
+	double len;
+	CHECK_CALL(lua_genpcall(L, _T("string.len"), _T("%&R<%s>%lf"), &ref, _T("Hello"), &len));
+	CHECK(len == 5);
+	CHECK_CALL(lua_genpcall(L, NULL, _T("%R<%s>%lf"), ref, _T("World!"), &len));
+	CHECK(len == 6);
+	luaL_unref(L, LUA_REGISTRYINDEX, ref);
+}
+
+static void test_registry_references(lua_State* L)
+{
+	int ref, refs[2];
+	double len;
+	CHECK_CALL(lua_genpcall(L, _T("return ..."), _T("%s>%o"), _T("configuration blob"), &ref));
+	CHECK_CALL(lua_genpcall(L, _T("return string.len(...)"), _T("%o>%lf"), ref, &len));
+	CHECK(len == 18);
+	CHECK_CALL(lua_genpcall(L, _T("return {'a', 'bc'}"), _T(">%2o"), refs));
+	CHECK_CALL(lua_genpcall(L, _T("local t = ...; assert(t[1] .. t[2] == 'abc')"), _T("%2o"), refs));
+	CHECK_CALL(lua_genpcall(L, _T("local s = ...; assert(s == 'configuration blob')"), _T("%#o"), ref));
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+	CHECK(lua_type(L, -1) != LUA_TSTRING);
+	lua_pop(L, 1);
+	luaL_unref(L, LUA_REGISTRYINDEX, refs[0]);
+	luaL_unref(L, LUA_REGISTRYINDEX, refs[1]);
+}
+
+static int sumRow(lua_State* L, void* ud)
+{
+	int* row = (int*)ud; /* emitted values, followed by sum and count */
+	row[2] += row[1];
+	row[3]++;
+	return row[0] < 3;
+}
+static void test_emit(lua_State* L)
+{
+	int row[4] = { 0, 0, 0, 0 };
+	CHECK_CALL(lua_genpcall(L, _T("local n, emit = ...; for i=1,n do if not emit(i, i*i) then break end end"),
+		_T("%+E<%d>%d%d"), sumRow, row, 10, &row[0], &row[1]));
+	CHECK(row[2] == 1 + 4 + 9 && row[3] == 3);
+}
+
+static void test_protected_calls(lua_State* L)
+{
+	int i, res = 0, top;
+	const TCHAR* err;
+	lua_settop(L, 0);
+	for(i=0;i<100;i++)
+		CHECK_CALL(lua_genpcall(L, _T("return ... + 1"), _T("%d>%d"), i, &res));
+	CHECK(res == 100 && lua_gettop(L) == 0);
+	top = lua_gettop(L);
+	err = lua_genpcall(L, _T("error('boom')"), _T(""));
+	CHECK(err != NULL && _tcsstr(err, _T("boom")) != NULL && lua_gettop(L) == top + 1);
+	CHECK(lua_genpcall(L, _T("return 'x'"), _T(">%d"), &res) != NULL);
+	lua_settop(L, 0);
+}
+
+#if LGENCALL_USE_FORK
+static void test_workers(lua_State* L)
+{
+	int i, fds[2], res = 0, status = -1;
+	pid_t pids[2];
+	double sum = 0;
+	const TCHAR* msg;
+	CHECK_CALL(lua_genpcall(L, _T("square = function(x) return x * x end"), _T("")));
+	CHECK(lua_genfork(L, 2, fds, pids) == 2);
+	for(i=0;i<2;i++)
+	{
+		CHECK_CALL(lua_genpcall(NULL, _T("return square(...)"), _T("%W<%d>%d"), fds[i], 7, &res));
+		CHECK(res == 49);
+	}
+	CHECK_CALL(lua_genpcall(NULL, _T("local t = ...; return t[1] + t[2]"), _T("%W<%2d>%lf"), fds[0], fds, &sum));
+	CHECK(sum == fds[0] + fds[1]);
+	msg = lua_genpcall(NULL, _T("error('remote')"), _T("%W<"), fds[1]);
+	CHECK(msg != NULL && _tcsstr(msg, _T("remote")) != NULL);
+	free((void*)msg);
+	/* A dead worker makes the call fail, without SIGPIPE */
+	kill(pids[1], SIGKILL);
+	CHECK(waitpid(pids[1], NULL, 0) == pids[1]);
+	for(i=0;i<2;i++)
+	{
+		msg = lua_genpcall(NULL, _T("return square(...)"), _T("%W<%d>%d"), fds[1], 7, &res);
+		CHECK(msg != NULL && _tcsstr(msg, _T("worker")) != NULL);
+		free((void*)msg);
+	}
+	for(i=0;i<2;i++)
+		close(fds[i]);
+	CHECK(waitpid(pids[0], &status, 0) == pids[0] && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+#endif
+
+#if LGENCALL_USE_THREADS
+static void count_done(void* ud, char* error)
+{
+	if(error == NULL)
+		(*(int*)ud)++;
+	free(error);
+}
+
+static void test_threads()
+{
+	lua_State* states[2];
+	lgencall_future* futures[8];
+	lgencall_executor* exec;
+	int i, results[8], nbdone = 0;
+	char name[8] = "x";
+	char* msg;
+	for(i=0;i<2;i++)
+	{
+		states[i] = luaL_newstate();
+		luaL_openlibs(states[i]);
+	}
+	exec = lua_genstart(states, 2);
+	CHECK(exec != NULL);
+	for(i=0;i<8;i++)
+		futures[i] = lua_gensubmitA(exec, NULL, NULL, "local a, s = ...; return a * 2 + #s", "%d%s>%d", i, name, &results[i]);
+	strcpy(name, "abcdef"); /* the inputs were copied at submission */
+	for(i=0;i<8;i++)
+	{
+		CHECK_CALL(lua_genwait(futures[i]));
+		CHECK(results[i] == 2*i + 1);
+	}
+	msg = lua_genwait(lua_gensubmitA(exec, NULL, NULL, "error('failed')", ""));
+	CHECK(msg != NULL && strstr(msg, "failed") != NULL);
+	free(msg);
+	msg = lua_genwait(lua_gensubmitA(exec, NULL, NULL, "", "%S<", &states[0]));
+	CHECK(msg != NULL && strstr(msg, "not allowed") != NULL);
+	free(msg);
+	msg = lua_genwait(lua_gensubmitA(exec, NULL, NULL, NULL, "%R<", 1));
+	CHECK(msg != NULL && strstr(msg, "not allowed") != NULL);
+	free(msg);
+	msg = lua_genwait(lua_gensubmitA(exec, NULL, NULL, "print", "%&R<", &i));
+	CHECK(msg != NULL && strstr(msg, "not allowed") != NULL);
+	free(msg);
+	for(i=0;i<4;i++)
+		lua_gensubmitA(exec, count_done, &nbdone, "return ...", "%d", i);
+	lua_genstop(exec);
+	CHECK(nbdone == 4);
+	for(i=0;i<2;i++)
+		lua_close(states[i]);
+}
+#endif
+
+static void test_output_checks(lua_State* L)
+{
+	int i = 1;
+	bool b = false;
+	double d = 1;
+	const TCHAR* msg = lua_genpcall(L, _T("return 1, 'x'"), _T(">%d%lf"), &i, &d);
+	CHECK(msg != NULL && _tcsstr(msg, _T("output argument #2: number expected, got string")) != NULL);
+	msg = lua_genpcall(L, _T("return 1"), _T(">%b"), &b);
+	CHECK(msg != NULL && _tcsstr(msg, _T("output argument #1: boolean expected, got number")) != NULL);
+	CHECK_CALL(lua_genpcall(L, _T("return 'x', 2, true"), _T(">%!d%!lf%!b"), &i, &d, &b));
+	CHECK(i == 0 && d == 2 && b);
+	CHECK(lua_genpcall(L, _T("return ..."), _T("%!d"), 0) != NULL);
+	lua_settop(L, 0);
+}
+
+static void test_error_report(lua_State* L)
+{
+	TCHAR msg[16];
+	lgencall_error err;
+	int res;
+	memset(&err, 0, sizeof(err));
+	err.message = msg;
+	err.size = sizeof(msg)/sizeof(msg[0]);
+	CHECK_CALL(lua_genpcall(L, _T("return ..."), _T("%X<%d>%d"), &err, 1, &res));
+	CHECK(err.code == LGENCALL_OK && res == 1);
+	CHECK(lua_genpcall(L, _T("return 'x'"), _T("%X<>%d%d"), &err, &res, &res) == msg);
+	CHECK(err.code == LGENCALL_ERRARGUMENT && err.argument == 1 && err.direction == 1 && msg[0] != 0);
+	CHECK(lua_genpcall(L, _T("error(string.rep('x', 100))"), _T("%X<"), &err) == msg);
+	CHECK(err.code == LGENCALL_ERRRUN && msg[err.size-1] == 0);
+	CHECK(lua_genpcall(L, _T("return ("), _T("%X<"), &err) == msg);
+	CHECK(err.code == LGENCALL_ERRSCRIPT);
+	CHECK(lua_genpcall(L, _T("return"), _T("%X<%d%"), &err, 0) == msg);
+	CHECK(err.code == LGENCALL_ERRFORMAT);
+	CHECK(lua_genpcall(L, _T("while true do end"), _T("%X %*B<"), &err, 100000) == msg);
+	CHECK(err.code == LGENCALL_ERRBUDGET);
+	CHECK(lua_genpcall(L, _T("while true do end"), _T("%X %.*B<"), &err, 10000) == msg);
+	CHECK(err.code == LGENCALL_ERRBUDGET && lua_gethook(L) == NULL);
+	CHECK_CALL(lua_genpcall(L, _T("for i=1,100 do end"), _T("%*B<"), 100000));
+	lua_settop(L, 0);
 }
 
 static void test_format_errors(lua_State* L)
 {
-	_tprintf(_T("%s\n"), lua_genpcall(L, _T("print 'hello'"), _T("%O u<%d>n'importe  quoi%d")));
+	CHECK(lua_genpcall(L, _T("print 'hello'"), _T("%O u<%d>n'importe  quoi%d")) != NULL);
+}
+
+static void test_format_bounds(lua_State* L)
+{
+	TCHAR format[2*600+1];
+	char data[24] = "a 24 bytes long buffer.";
+	void* ptr = NULL;
+	int i;
+	CHECK(lua_genpcall(L, _T("return"), _T("%.99999999999999999999f"), (void*)NULL) != NULL);
+	CHECK(lua_genpcall(L, _T("return"), _T("%99999999999999999999d"), (void*)NULL) != NULL);
+	CHECK(lua_genpcall(L, _T("return"), _T("%LLd"), 0) != NULL);
+	CHECK(lua_genpcall(L, _T("return"), _T("%d%"), 0) != NULL);
+	CHECK(lua_genpcall(L, _T("return"), _T("%dd"), 0) != NULL);
+	for(i=0;i<600;i++)
+	{
+		format[2*i] = _T('%');
+		format[2*i+1] = _T('n');
+	}
+	format[2*600] = 0;
+	CHECK_CALL(lua_genpcall(L, _T("assert(select('#', ...) == 600)"), format));
+	CHECK_CALL(lua_genpcall(L, _T("return ..."), _T("%.*lp>%lp"), (int)sizeof(data), data, &ptr));
+	CHECK(ptr != NULL && memcmp(ptr, data, sizeof(data)) == 0);
 }
 
 int main(int argc, char* argv[])
@@ -205,25 +758,54 @@ int main(int argc, char* argv[])
 
 	L = lua_open();
 	luaL_openlibs(L);
-	
+
 	test_in_numbers(L);
 	test_in_other_scalars(L);
 	test_in_function_callback(L);
 	test_in_arrays(L);
+	test_in_float_arrays(L);
+	test_in_shaped_arrays(L);
+	test_in_reused_tables(L);
 	test_in_strings(L);
 	test_in_string_lists(L);
+	test_in_rows(L);
 
 	test_out_numbers(L);
 	test_out_other_scalars(L);
 	test_out_function_callback(L);
 	test_out_arrays(L);
+	test_out_large_arrays(L);
+	test_out_shaped_arrays(L);
 	test_out_strings(L);
 	test_out_string_lists(L);
 
 	test_null_parameters(L);
+	test_directives(L);
+#if LGENCALL_USE_BYTECODE_STORE
+	test_bytecode_store(L);
+#endif
+	test_garbage_collection(L);
+	test_profiler(L);
+#if LGENCALL_USE_TRACE
+	test_tracer(L);
+#endif
+	test_memoization(L);
+	test_function_reference(L);
+	test_registry_references(L);
+	test_emit(L);
+	test_protected_calls(L);
+#if LGENCALL_USE_FORK
+	test_workers(L);
+#endif
+#if LGENCALL_USE_THREADS
+	test_threads();
+#endif
+	test_output_checks(L);
+	test_error_report(L);
 	test_format_errors(L);
+	test_format_bounds(L);
 
 	lua_close(L);
-	return 0;
+	printf("%d error(s)\n", nb_errors);
+	return nb_errors != 0;
 }
-